@@ -37,3 +37,43 @@ public:
 
   ~CollectorList() { if (free_) R_ReleaseObject(data_); }
 };
+
+// Like CollectorList, but collects strings directly into a character vector.
+class CollectorString {
+  SEXP data_;
+  R_xlen_t n_;
+
+public:
+  CollectorString(R_xlen_t size = 1) : n_(0) {
+    data_ = Rf_allocVector(STRSXP, size < 1 ? 1 : size);
+    R_PreserveObject(data_);
+  }
+
+  void push_back(const char* x) {
+    if (Rf_xlength(data_) == n_) {
+      resize(n_ * 2);
+    }
+    SET_STRING_ELT(data_, n_++, Rf_mkChar(x));
+  }
+
+  R_xlen_t size() const { return n_; }
+
+  operator SEXP() {
+    if (Rf_xlength(data_) != n_) {
+      resize(n_);
+    }
+    return data_;
+  }
+
+  ~CollectorString() { R_ReleaseObject(data_); }
+
+private:
+  // The old vector stays preserved until the new one is, as allocating the
+  // new vector can trigger a garbage collection.
+  void resize(R_xlen_t size) {
+    SEXP data = Rf_xlengthgets(data_, size);
+    R_PreserveObject(data);
+    R_ReleaseObject(data_);
+    data_ = data;
+  }
+};
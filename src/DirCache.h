@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "uv.h"
+
+#include "DirHandle.h"
+
+// Caches the entries of directories between traversals, so repeatedly listing
+// a mostly unchanged tree only needs to stat each directory rather than read
+// it again.
+//
+// A listing is keyed on the path of the directory and is only used if the
+// device, inode, modification and change times of the directory are the same
+// as when it was read. Directories modified within the last couple of seconds
+// are not cached, as a change in the same timestamp tick as the read would
+// not be seen. Any later change to the entries updates the modification time,
+// so an older one is enough.
+//
+// All of the entries are cached, including hidden ones, so a listing can be
+// reused whatever the options of the traversal. At most `max_entries` entries
+// are kept, evicting the least recently used listings first. The cache is
+// shared by the worker threads of a parallel traversal.
+class DirCache {
+public:
+  explicit DirCache(size_t max_entries)
+      : max_entries_(max_entries), entries_(0), hits_(0) {
+    uv_mutex_init(&mutex_);
+  }
+
+  ~DirCache() { uv_mutex_destroy(&mutex_); }
+
+  // Read the entries of `dir` like DirHandle::read(), from the cache if the
+  // directory has not changed since it was cached.
+  int read(DirHandle& dir, bool all, bool sort, std::vector<DirEntry>* entries) {
+    uv_stat_t st;
+    memset(&st, 0, sizeof(st));
+    int err = dir.stat_self(&st);
+    if (err == 0 && lookup(dir.path(), st, entries)) {
+      select(all, sort, entries);
+      return 0;
+    }
+
+    int res = dir.read(true, false, entries);
+    if (res < 0) {
+      return res;
+    }
+    if (err == 0 && cacheable(st, *entries)) {
+      store(dir.path(), st, *entries);
+    }
+    select(all, sort, entries);
+    return 0;
+  }
+
+  void clear() {
+    uv_mutex_lock(&mutex_);
+    listings_.clear();
+    order_.clear();
+    entries_ = 0;
+    hits_ = 0;
+    uv_mutex_unlock(&mutex_);
+  }
+
+  // The number of cached directories.
+  size_t size() {
+    uv_mutex_lock(&mutex_);
+    size_t n = listings_.size();
+    uv_mutex_unlock(&mutex_);
+    return n;
+  }
+
+  // The number of listings served from the cache since it was last cleared.
+  size_t hits() {
+    uv_mutex_lock(&mutex_);
+    size_t n = hits_;
+    uv_mutex_unlock(&mutex_);
+    return n;
+  }
+
+private:
+  DirCache(const DirCache&);
+  DirCache& operator=(const DirCache&);
+
+  struct Listing {
+    uint64_t dev;
+    uint64_t ino;
+    uv_timespec_t mtime;
+    uv_timespec_t ctime;
+    std::vector<DirEntry> entries;
+    // The position of the listing in `order_`.
+    std::list<std::string>::iterator used;
+  };
+
+  static bool same_time(const uv_timespec_t& x, const uv_timespec_t& y) {
+    return x.tv_sec == y.tv_sec && x.tv_nsec == y.tv_nsec;
+  }
+
+  static bool unchanged(const Listing& l, const uv_stat_t& st) {
+    return l.dev == st.st_dev && l.ino == st.st_ino &&
+           same_time(l.mtime, st.st_mtim) && same_time(l.ctime, st.st_ctim);
+  }
+
+  // Entries whose type could not be determined are read again next time.
+  static bool cacheable(const uv_stat_t& st, const std::vector<DirEntry>& entries) {
+    if (st.st_mtim.tv_sec >= time(NULL) - 2) {
+      return false;
+    }
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (entries[i].err != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Remove the hidden entries unless `all` and sort the rest, as
+  // DirHandle::read() would.
+  static void select(bool all, bool sort, std::vector<DirEntry>* entries) {
+    if (!all) {
+      size_t n = 0;
+      for (size_t i = 0; i < entries->size(); ++i) {
+        if ((*entries)[i].name[0] == '.') {
+          continue;
+        }
+        if (n != i) {
+          (*entries)[n] = (*entries)[i];
+        }
+        ++n;
+      }
+      entries->resize(n);
+    }
+#ifndef __WIN32
+    if (sort) {
+      std::sort(entries->begin(), entries->end());
+    }
+#else
+    (void)sort;
+#endif
+  }
+
+  bool lookup(
+      const std::string& path,
+      const uv_stat_t& st,
+      std::vector<DirEntry>* entries) {
+    uv_mutex_lock(&mutex_);
+    std::map<std::string, Listing>::iterator it = listings_.find(path);
+    bool found = it != listings_.end() && unchanged(it->second, st);
+    if (found) {
+      *entries = it->second.entries;
+      order_.splice(order_.begin(), order_, it->second.used);
+      ++hits_;
+    }
+    uv_mutex_unlock(&mutex_);
+    return found;
+  }
+
+  void store(
+      const std::string& path,
+      const uv_stat_t& st,
+      const std::vector<DirEntry>& entries) {
+    // Copy the entries before taking the lock.
+    std::vector<DirEntry> copy(entries);
+
+    uv_mutex_lock(&mutex_);
+    std::map<std::string, Listing>::iterator it = listings_.find(path);
+    if (it == listings_.end()) {
+      it = listings_.insert(std::make_pair(path, Listing())).first;
+      order_.push_front(path);
+    } else {
+      entries_ -= it->second.entries.size();
+      order_.splice(order_.begin(), order_, it->second.used);
+    }
+    Listing& listing = it->second;
+    listing.dev = st.st_dev;
+    listing.ino = st.st_ino;
+    listing.mtime = st.st_mtim;
+    listing.ctime = st.st_ctim;
+    listing.entries.swap(copy);
+    listing.used = order_.begin();
+    entries_ += listing.entries.size();
+
+    // Evict the least recently used listings, never the one just stored.
+    while (entries_ > max_entries_ && order_.size() > 1) {
+      std::map<std::string, Listing>::iterator last =
+          listings_.find(order_.back());
+      entries_ -= last->second.entries.size();
+      listings_.erase(last);
+      order_.pop_back();
+    }
+    uv_mutex_unlock(&mutex_);
+  }
+
+  std::map<std::string, Listing> listings_;
+  // The paths of the listings, most recently used first.
+  std::list<std::string> order_;
+  size_t max_entries_;
+  // The total number of cached entries.
+  size_t entries_;
+  size_t hits_;
+  uv_mutex_t mutex_;
+};
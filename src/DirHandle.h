@@ -0,0 +1,525 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifndef __WIN32
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+#include "uv.h"
+
+#include "utils.h"
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+// An entry of a directory read by DirHandle.
+struct DirEntry {
+  std::string name;
+  uv_dirent_type_t type;
+  // The error from stat'ing an entry whose type was not reported by the
+  // directory read itself.
+  int err;
+};
+
+inline bool operator<(const DirEntry& x, const DirEntry& y) {
+  return strcmp(x.name.c_str(), y.name.c_str()) < 0;
+}
+
+// The prefix to add to the names of the entries of `path`. If `path` is '.'
+// the names are used as is.
+inline std::string dir_entry_prefix(const std::string& path) {
+  if (path == ".") {
+    return std::string();
+  }
+  if (!path.empty() && path[path.size() - 1] == '/') {
+    return path;
+  }
+  return path + '/';
+}
+
+#ifndef __WIN32
+// Convert the result of stat(2) like libuv does, so the results of
+// DirHandle::stat() match those of uv_fs_lstat().
+inline void dir_stat_convert(const struct stat& src, uv_stat_t* dst) {
+  dst->st_dev = src.st_dev;
+  dst->st_mode = src.st_mode;
+  dst->st_nlink = src.st_nlink;
+  dst->st_uid = src.st_uid;
+  dst->st_gid = src.st_gid;
+  dst->st_rdev = src.st_rdev;
+  dst->st_ino = src.st_ino;
+  dst->st_size = src.st_size;
+  dst->st_blksize = src.st_blksize;
+  dst->st_blocks = src.st_blocks;
+#if defined(__APPLE__)
+  dst->st_atim.tv_sec = src.st_atimespec.tv_sec;
+  dst->st_atim.tv_nsec = src.st_atimespec.tv_nsec;
+  dst->st_mtim.tv_sec = src.st_mtimespec.tv_sec;
+  dst->st_mtim.tv_nsec = src.st_mtimespec.tv_nsec;
+  dst->st_ctim.tv_sec = src.st_ctimespec.tv_sec;
+  dst->st_ctim.tv_nsec = src.st_ctimespec.tv_nsec;
+  dst->st_birthtim.tv_sec = src.st_birthtimespec.tv_sec;
+  dst->st_birthtim.tv_nsec = src.st_birthtimespec.tv_nsec;
+  dst->st_flags = src.st_flags;
+  dst->st_gen = src.st_gen;
+#else
+  dst->st_atim.tv_sec = src.st_atim.tv_sec;
+  dst->st_atim.tv_nsec = src.st_atim.tv_nsec;
+  dst->st_mtim.tv_sec = src.st_mtim.tv_sec;
+  dst->st_mtim.tv_nsec = src.st_mtim.tv_nsec;
+  dst->st_ctim.tv_sec = src.st_ctim.tv_sec;
+  dst->st_ctim.tv_nsec = src.st_ctim.tv_nsec;
+#if defined(__FreeBSD__) || defined(__NetBSD__)
+  dst->st_birthtim.tv_sec = src.st_birthtim.tv_sec;
+  dst->st_birthtim.tv_nsec = src.st_birthtim.tv_nsec;
+  dst->st_flags = src.st_flags;
+  dst->st_gen = src.st_gen;
+#else
+  dst->st_birthtim.tv_sec = src.st_ctim.tv_sec;
+  dst->st_birthtim.tv_nsec = src.st_ctim.tv_nsec;
+  dst->st_flags = 0;
+  dst->st_gen = 0;
+#endif
+#endif
+}
+#endif
+
+// An open directory.
+//
+// On POSIX systems the directory is read through its file descriptor, entries
+// of unknown type are stat'ed relative to it and sub-directories are opened
+// relative to it, so the kernel does not resolve every component of the full
+// path for each entry. On Windows the full path is passed to libuv instead.
+//
+// Entries can be read all at once with `read()`, or streamed a batch at a
+// time with `next()`, which never holds more than one batch in memory. If
+// `stats` are requested every entry is lstat'ed relative to the directory and
+// its type is taken from the result.
+//
+// Unlike the rest of fs these never call into R, so they can be used from
+// worker threads. Functions return 0 or a libuv error code.
+class DirHandle {
+public:
+  DirHandle() : dir_(NULL) {}
+
+  ~DirHandle() { close(); }
+
+  // Open `path`. If `parent` is open, `name` is opened relative to it
+  // instead, where `path` is the full path of that entry. Unless `follow`, a
+  // link at `path` is not followed and fails with UV_ELOOP, on POSIX systems.
+  int open(
+      const std::string& path,
+      const DirHandle* parent = NULL,
+      const char* name = NULL,
+      bool follow = true) {
+    path_ = path;
+#ifndef __WIN32
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    if (!follow) {
+      flags |= O_NOFOLLOW;
+    }
+    int fd;
+    if (parent != NULL && parent->dir_ != NULL && name != NULL) {
+      fd = openat(dirfd(parent->dir_), name, flags);
+    } else {
+      fd = ::open(path.c_str(), flags);
+    }
+    if (fd < 0) {
+      return -errno;
+    }
+    dir_ = fdopendir(fd);
+    if (dir_ == NULL) {
+      int err = -errno;
+      ::close(fd);
+      return err;
+    }
+#else
+    (void)parent;
+    (void)name;
+    (void)follow;
+    uv_fs_t req;
+    int res = uv_fs_opendir(uv_default_loop(), &req, path.c_str(), NULL);
+    if (res < 0) {
+      uv_fs_req_cleanup(&req);
+      return res;
+    }
+    dir_ = static_cast<uv_dir_t*>(req.ptr);
+    uv_fs_req_cleanup(&req);
+#endif
+    return 0;
+  }
+
+  // Read up to `n` more entries, other than '.' and '..' and hidden entries
+  // unless `all`, appending them to `entries` in the order the file system
+  // returns them. Returns the number of entries read, which is 0 once the
+  // directory is exhausted.
+  int next(
+      bool all,
+      std::vector<DirEntry>* entries,
+      int n,
+      std::vector<uv_stat_t>* stats = NULL) {
+    int count = 0;
+#ifndef __WIN32
+    while (count < n) {
+      errno = 0;
+      dirent* e = readdir(dir_);
+      if (e == NULL) {
+        if (errno != 0) {
+          return -errno;
+        }
+        break;
+      }
+#ifdef DT_UNKNOWN
+      uv_dirent_type_t type = dirent_type(e->d_type);
+#else
+      uv_dirent_type_t type = UV_DIRENT_UNKNOWN;
+#endif
+      count += add_entry(all, e->d_name, type, entries, stats);
+    }
+#else
+    uv_dirent_t dirents[64];
+    while (count < n) {
+      dir_->dirents = dirents;
+      dir_->nentries = std::min(n - count, 64);
+      uv_fs_t req;
+      int res = uv_fs_readdir(uv_default_loop(), &req, dir_, NULL);
+      if (res <= 0) {
+        uv_fs_req_cleanup(&req);
+        if (res < 0) {
+          return res;
+        }
+        break;
+      }
+      for (int i = 0; i < res; ++i) {
+        count += add_entry(
+            all, dirents[i].name, dirents[i].type, entries, stats);
+      }
+      uv_fs_req_cleanup(&req);
+    }
+#endif
+    return count;
+  }
+
+  // Read all of the remaining entries into `entries`. If `sort` the entries
+  // are then sorted by name on POSIX systems, like scandir(3); on Windows they
+  // are kept in the order of the file system, which is sorted on NTFS.
+  int read(
+      bool all,
+      bool sort,
+      std::vector<DirEntry>* entries,
+      std::vector<uv_stat_t>* stats = NULL) {
+    entries->clear();
+    if (stats != NULL) {
+      stats->clear();
+    }
+    for (;;) {
+      int res = next(all, entries, 1024, stats);
+      if (res < 0) {
+        return res;
+      }
+      if (res == 0) {
+        break;
+      }
+    }
+#ifndef __WIN32
+    if (sort && stats == NULL) {
+      std::sort(entries->begin(), entries->end());
+    } else if (sort) {
+      sort_with_stats(entries, stats);
+    }
+#else
+    (void)sort;
+#endif
+    return 0;
+  }
+
+  // Read the contents of the file `name` in the directory.
+  int read_file(const char* name, std::string* contents) {
+    contents->clear();
+    char buf[4096];
+#ifndef __WIN32
+    int fd = openat(dirfd(dir_), name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return -errno;
+    }
+    for (;;) {
+      ssize_t res = ::read(fd, buf, sizeof(buf));
+      if (res < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        int err = -errno;
+        ::close(fd);
+        return err;
+      }
+      if (res == 0) {
+        break;
+      }
+      contents->append(buf, res);
+    }
+    ::close(fd);
+#else
+    uv_fs_t req;
+    std::string path = dir_entry_prefix(path_) + name;
+    int fd = uv_fs_open(
+        uv_default_loop(), &req, path.c_str(), UV_FS_O_RDONLY, 0, NULL);
+    uv_fs_req_cleanup(&req);
+    if (fd < 0) {
+      return fd;
+    }
+    uv_buf_t iov = uv_buf_init(buf, sizeof(buf));
+    for (;;) {
+      int res = uv_fs_read(uv_default_loop(), &req, fd, &iov, 1, -1, NULL);
+      uv_fs_req_cleanup(&req);
+      if (res <= 0) {
+        uv_fs_close(uv_default_loop(), &req, fd, NULL);
+        uv_fs_req_cleanup(&req);
+        return res;
+      }
+      contents->append(buf, res);
+    }
+#endif
+    return 0;
+  }
+
+  // lstat the entry `name` of the directory.
+  int stat(const char* name, uv_stat_t* st) {
+#ifndef __WIN32
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+    // Like libuv, prefer statx(2), which also returns the birth time.
+    struct statx stx;
+    if (statx(
+            dirfd(dir_),
+            name,
+            AT_SYMLINK_NOFOLLOW,
+            STATX_BASIC_STATS | STATX_BTIME,
+            &stx) == 0) {
+      st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+      st->st_mode = stx.stx_mode;
+      st->st_nlink = stx.stx_nlink;
+      st->st_uid = stx.stx_uid;
+      st->st_gid = stx.stx_gid;
+      st->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+      st->st_ino = stx.stx_ino;
+      st->st_size = stx.stx_size;
+      st->st_blksize = stx.stx_blksize;
+      st->st_blocks = stx.stx_blocks;
+      st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+      st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+      st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+      st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+      st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+      st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+      st->st_birthtim.tv_sec = stx.stx_btime.tv_sec;
+      st->st_birthtim.tv_nsec = stx.stx_btime.tv_nsec;
+      st->st_flags = 0;
+      st->st_gen = 0;
+      return 0;
+    }
+    if (errno != EINVAL && errno != EPERM && errno != ENOSYS &&
+        errno != EOPNOTSUPP) {
+      return -errno;
+    }
+#endif
+    struct stat buf;
+    if (fstatat(dirfd(dir_), name, &buf, AT_SYMLINK_NOFOLLOW) != 0) {
+      return -errno;
+    }
+    dir_stat_convert(buf, st);
+    return 0;
+#else
+    uv_fs_t req;
+    std::string path = dir_entry_prefix(path_) + name;
+    int res = uv_fs_lstat(uv_default_loop(), &req, path.c_str(), NULL);
+    if (res == 0) {
+      *st = req.statbuf;
+    }
+    uv_fs_req_cleanup(&req);
+    return res;
+#endif
+  }
+
+  // stat the directory itself.
+  int stat_self(uv_stat_t* st) {
+#ifndef __WIN32
+    struct stat buf;
+    if (fstat(dirfd(dir_), &buf) != 0) {
+      return -errno;
+    }
+    dir_stat_convert(buf, st);
+    return 0;
+#else
+    uv_fs_t req;
+    int res = uv_fs_stat(uv_default_loop(), &req, path_.c_str(), NULL);
+    if (res == 0) {
+      *st = req.statbuf;
+    }
+    uv_fs_req_cleanup(&req);
+    return res;
+#endif
+  }
+
+  // Remove the entry `name` of the directory, which must be an empty
+  // directory if `is_dir`, otherwise it must not be a directory.
+  int remove(const char* name, bool is_dir) {
+#ifndef __WIN32
+    if (unlinkat(dirfd(dir_), name, is_dir ? AT_REMOVEDIR : 0) != 0) {
+      return -errno;
+    }
+    return 0;
+#else
+    uv_fs_t req;
+    std::string path = dir_entry_prefix(path_) + name;
+    int res = is_dir ? uv_fs_rmdir(uv_default_loop(), &req, path.c_str(), NULL)
+                     : uv_fs_unlink(uv_default_loop(), &req, path.c_str(), NULL);
+    uv_fs_req_cleanup(&req);
+    return res;
+#endif
+  }
+
+#ifndef __WIN32
+  // The file descriptor of the open directory, for the `*at()` functions.
+  int fd() const { return dirfd(dir_); }
+#endif
+
+  // Close the directory, sub-directories are then opened by their full path.
+  void close() {
+    if (dir_ != NULL) {
+#ifndef __WIN32
+      closedir(dir_);
+#else
+      uv_fs_t req;
+      uv_fs_closedir(uv_default_loop(), &req, dir_, NULL);
+      uv_fs_req_cleanup(&req);
+#endif
+      dir_ = NULL;
+    }
+  }
+
+  const std::string& path() const { return path_; }
+
+private:
+  DirHandle(const DirHandle&);
+  DirHandle& operator=(const DirHandle&);
+
+  // Append the entry `name` unless it is skipped, returning the number of
+  // entries added.
+  int add_entry(
+      bool all,
+      const char* name,
+      uv_dirent_type_t type,
+      std::vector<DirEntry>* entries,
+      std::vector<uv_stat_t>* stats) {
+    if (!all && name[0] == '.') {
+      return 0;
+    }
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      return 0;
+    }
+    DirEntry entry;
+    entry.name = name;
+    entry.type = type;
+    entry.err = 0;
+    if (stats != NULL) {
+      uv_stat_t st;
+      memset(&st, 0, sizeof(st));
+      entry.err = stat(name, &st);
+      if (entry.err == 0) {
+        entry.type = mode_dirent_type(st.st_mode);
+      }
+      stats->push_back(st);
+    } else if (entry.type == UV_DIRENT_UNKNOWN) {
+      entry.err = stat_type(name, &entry.type);
+    }
+    entries->push_back(entry);
+    return 1;
+  }
+
+  class EntryOrder {
+    const std::vector<DirEntry>& entries_;
+
+  public:
+    explicit EntryOrder(const std::vector<DirEntry>& entries)
+        : entries_(entries) {}
+
+    bool operator()(size_t x, size_t y) const {
+      return entries_[x] < entries_[y];
+    }
+  };
+
+  // Sort the entries and their stats together.
+  static void
+  sort_with_stats(std::vector<DirEntry>* entries, std::vector<uv_stat_t>* stats) {
+    std::vector<size_t> order(entries->size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), EntryOrder(*entries));
+
+    std::vector<DirEntry> sorted_entries(order.size());
+    std::vector<uv_stat_t> sorted_stats(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      sorted_entries[i] = (*entries)[order[i]];
+      sorted_stats[i] = (*stats)[order[i]];
+    }
+    entries->swap(sorted_entries);
+    stats->swap(sorted_stats);
+  }
+
+#ifndef __WIN32
+#ifdef DT_UNKNOWN
+  static uv_dirent_type_t dirent_type(unsigned char type) {
+    switch (type) {
+    case DT_REG:
+      return UV_DIRENT_FILE;
+    case DT_DIR:
+      return UV_DIRENT_DIR;
+    case DT_LNK:
+      return UV_DIRENT_LINK;
+    case DT_FIFO:
+      return UV_DIRENT_FIFO;
+    case DT_SOCK:
+      return UV_DIRENT_SOCKET;
+    case DT_CHR:
+      return UV_DIRENT_CHAR;
+    case DT_BLK:
+      return UV_DIRENT_BLOCK;
+    default:
+      return UV_DIRENT_UNKNOWN;
+    }
+  }
+#endif
+
+  int stat_type(const char* name, uv_dirent_type_t* type) {
+    struct stat st;
+    if (fstatat(dirfd(dir_), name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+      *type = UV_DIRENT_UNKNOWN;
+      return -errno;
+    }
+    *type = mode_dirent_type(st.st_mode);
+    return 0;
+  }
+
+  DIR* dir_;
+#else
+  int stat_type(const char* name, uv_dirent_type_t* type) {
+    return lstat_dirent_type((dir_entry_prefix(path_) + name).c_str(), type);
+  }
+
+  uv_dir_t* dir_;
+#endif
+  std::string path_;
+};
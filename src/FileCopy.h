@@ -0,0 +1,345 @@
+#pragma once
+
+#include <cstring>
+#include <vector>
+
+#ifndef __WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+// From <linux/fs.h>, which conflicts with <sys/mount.h> on some systems.
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
+
+#include "uv.h"
+
+// Copies a single file, like `uv_fs_copyfile()`: the new file gets the mode
+// of the original, is only replaced if `overwrite` is true and is removed
+// again if the copy fails. Returns 0 or a libuv error code.
+//
+// With `AUTO` the new file is first cloned, sharing its data with the
+// original until either is changed, which is instant on file systems with
+// copy-on-write reflinks such as btrfs, XFS and APFS. With `ALWAYS` it is an
+// error if the file cannot be cloned, and with `NEVER` the data is always
+// copied.
+//
+// On Linux the data is otherwise copied in the kernel with
+// `copy_file_range()`, falling back to reads and writes where it is not
+// supported, e.g. between file systems on older kernels. The holes of sparse
+// files are skipped, so the copy is as sparse as the original. As
+// `copy_file_range()` may itself clone the data, `NEVER` always uses reads
+// and writes. Elsewhere this uses `uv_fs_copyfile()`.
+//
+// `link()` creates a hard link instead, and only copies files which can not
+// be linked. `set_times()` and `compare()` let callers keep copies in sync
+// with their originals.
+//
+// This never calls into R, so it can be used from worker threads.
+class FileCopy {
+public:
+  enum Reflink { NEVER, AUTO, ALWAYS };
+
+  static int
+  copy(const char* from, const char* to, bool overwrite, Reflink reflink) {
+#ifdef __linux__
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+      return -errno;
+    }
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+      int err = -errno;
+      close(in);
+      return err;
+    }
+
+    // The new file is not truncated until it is known not to be the original.
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (overwrite ? 0 : O_EXCL);
+    int out = open(to, flags, st.st_mode);
+    if (out < 0) {
+      int err = -errno;
+      close(in);
+      return err;
+    }
+    struct stat out_st;
+    if (fstat(out, &out_st) == 0 && out_st.st_dev == st.st_dev &&
+        out_st.st_ino == st.st_ino) {
+      close(out);
+      close(in);
+      return 0;
+    }
+
+    int err = 0;
+    if (ftruncate(out, 0) != 0) {
+      err = -errno;
+    }
+    // Changing the mode is not permitted on some network file systems, where
+    // it is meaningless anyway.
+    if (err == 0 && fchmod(out, st.st_mode) != 0 && errno != EPERM) {
+      err = -errno;
+    }
+    bool cloned = false;
+    if (err == 0 && reflink != NEVER) {
+      cloned = ioctl(out, FICLONE, in) == 0;
+      if (!cloned && reflink == ALWAYS) {
+        err = -errno;
+      }
+    }
+    if (err == 0 && !cloned) {
+      err = copy_data(in, out, st, reflink != NEVER);
+    }
+
+    if (close(out) != 0 && err == 0) {
+      err = -errno;
+    }
+    close(in);
+    if (err != 0) {
+      unlink(to);
+    }
+    return err;
+#else
+    int flags = overwrite ? 0 : UV_FS_COPYFILE_EXCL;
+    if (reflink == AUTO) {
+      flags |= UV_FS_COPYFILE_FICLONE;
+    } else if (reflink == ALWAYS) {
+      flags |= UV_FS_COPYFILE_FICLONE_FORCE;
+    }
+    uv_fs_t req;
+    int err = uv_fs_copyfile(uv_default_loop(), &req, from, to, flags, NULL);
+    uv_fs_req_cleanup(&req);
+    return err;
+#endif
+  }
+
+  // Create `to` as a hard link to `from`, replacing any existing file if
+  // `overwrite` is true. Files which can not be linked, e.g. as they are on
+  // another device, are copied instead.
+  static int
+  link(const char* from, const char* to, bool overwrite, Reflink reflink) {
+    uv_fs_t req;
+    int err = uv_fs_link(uv_default_loop(), &req, from, to, NULL);
+    uv_fs_req_cleanup(&req);
+    if (err == UV_EEXIST && overwrite) {
+      uv_fs_unlink(uv_default_loop(), &req, to, NULL);
+      uv_fs_req_cleanup(&req);
+      err = uv_fs_link(uv_default_loop(), &req, from, to, NULL);
+      uv_fs_req_cleanup(&req);
+    }
+    if (err == UV_EXDEV || err == UV_EMLINK || err == UV_EPERM ||
+        err == UV_ENOTSUP) {
+      return copy(from, to, overwrite, reflink);
+    }
+    return err;
+  }
+
+  // Set the access and modification times of `path`, or of the link itself
+  // if it is a symbolic link, to those in `st`.
+  static int set_times(const char* path, const uv_stat_t& st) {
+#ifndef __WIN32
+    struct timespec times[2];
+    times[0].tv_sec = st.st_atim.tv_sec;
+    times[0].tv_nsec = st.st_atim.tv_nsec;
+    times[1].tv_sec = st.st_mtim.tv_sec;
+    times[1].tv_nsec = st.st_mtim.tv_nsec;
+    if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) != 0) {
+      return -errno;
+    }
+    return 0;
+#else
+    uv_fs_t req;
+    int err = uv_fs_lutime(
+        uv_default_loop(),
+        &req,
+        path,
+        st.st_atim.tv_sec + 1e-9 * st.st_atim.tv_nsec,
+        st.st_mtim.tv_sec + 1e-9 * st.st_mtim.tv_nsec,
+        NULL);
+    uv_fs_req_cleanup(&req);
+    return err;
+#endif
+  }
+
+  // Compare the contents of the files `x` and `y`, setting `*same`.
+  static int compare(const char* x, const char* y, bool* same) {
+    *same = false;
+    uv_fs_t req;
+    int x_fd = uv_fs_open(uv_default_loop(), &req, x, UV_FS_O_RDONLY, 0, NULL);
+    uv_fs_req_cleanup(&req);
+    if (x_fd < 0) {
+      return x_fd;
+    }
+    int y_fd = uv_fs_open(uv_default_loop(), &req, y, UV_FS_O_RDONLY, 0, NULL);
+    uv_fs_req_cleanup(&req);
+    if (y_fd < 0) {
+      uv_fs_close(uv_default_loop(), &req, x_fd, NULL);
+      uv_fs_req_cleanup(&req);
+      return y_fd;
+    }
+
+    std::vector<char> x_buf(1 << 18);
+    std::vector<char> y_buf(x_buf.size());
+    int err = 0;
+    for (;;) {
+      int x_n = read_full(x_fd, &x_buf);
+      int y_n = read_full(y_fd, &y_buf);
+      if (x_n < 0 || y_n < 0) {
+        err = x_n < 0 ? x_n : y_n;
+        break;
+      }
+      if (x_n != y_n || memcmp(&x_buf[0], &y_buf[0], x_n) != 0) {
+        break;
+      }
+      if (x_n == 0) {
+        *same = true;
+        break;
+      }
+    }
+
+    uv_fs_close(uv_default_loop(), &req, y_fd, NULL);
+    uv_fs_req_cleanup(&req);
+    uv_fs_close(uv_default_loop(), &req, x_fd, NULL);
+    uv_fs_req_cleanup(&req);
+    return err;
+  }
+
+private:
+  // Fill `buf` from `fd`, unless the end of the file is reached first.
+  // Returns the number of bytes read.
+  static int read_full(uv_file fd, std::vector<char>* buf) {
+    size_t n = 0;
+    while (n < buf->size()) {
+      uv_fs_t req;
+      uv_buf_t b = uv_buf_init(&(*buf)[n], buf->size() - n);
+      int res = uv_fs_read(uv_default_loop(), &req, fd, &b, 1, -1, NULL);
+      uv_fs_req_cleanup(&req);
+      if (res < 0) {
+        return res;
+      }
+      if (res == 0) {
+        break;
+      }
+      n += res;
+    }
+    return n;
+  }
+
+#ifdef __linux__
+  // Copy the data of `in`, skipping its holes if it is sparse.
+  static int
+  copy_data(int in, int out, const struct stat& st, bool in_kernel) {
+    off_t size = st.st_size;
+    // Like `cp`, only look for holes in files with fewer blocks than bytes.
+    bool sparse = static_cast<off_t>(st.st_blocks) * 512 < size;
+    std::vector<char> buf;
+    off_t pos = 0;
+    while (pos < size) {
+      off_t end = size;
+      if (sparse) {
+        off_t data = lseek(in, pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+          // The rest of the file is a hole.
+          break;
+        }
+        if (data < 0) {
+          // Holes can not be found on this file system.
+          sparse = false;
+          continue;
+        }
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        pos = data;
+        end = hole < 0 || hole > size ? size : hole;
+      }
+      int err = copy_range(in, out, pos, end, &in_kernel, &buf);
+      if (err != 0) {
+        return err;
+      }
+      pos = end;
+    }
+    // Recreate any hole at the end of the file.
+    if (sparse && ftruncate(out, size) != 0) {
+      return -errno;
+    }
+    return 0;
+  }
+
+  // Copy the bytes `[pos, end)` of `in` to the same offsets of `out`. If
+  // `copy_file_range()` is not supported `*in_kernel` is set to false and
+  // `buf` is used instead.
+  static int copy_range(
+      int in,
+      int out,
+      off_t pos,
+      off_t end,
+      bool* in_kernel,
+      std::vector<char>* buf) {
+#ifdef __NR_copy_file_range
+    while (*in_kernel && pos < end) {
+      loff_t in_off = pos;
+      loff_t out_off = pos;
+      ssize_t n = syscall(
+          __NR_copy_file_range, in, &in_off, out, &out_off, end - pos, 0);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+            errno != EOPNOTSUPP && errno != EPERM) {
+          return -errno;
+        }
+        *in_kernel = false;
+        break;
+      }
+      if (n == 0) {
+        // Either the file was truncated while being copied, or its size is
+        // not known to the kernel, as for some virtual files, so read it.
+        *in_kernel = false;
+        break;
+      }
+      pos += n;
+    }
+#else
+    *in_kernel = false;
+#endif
+    if (pos < end && buf->empty()) {
+      buf->resize(1 << 18);
+    }
+    while (pos < end) {
+      size_t len = buf->size();
+      if (static_cast<off_t>(len) > end - pos) {
+        len = end - pos;
+      }
+      ssize_t n = pread(in, &(*buf)[0], len, pos);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        return -errno;
+      }
+      if (n == 0) {
+        return 0;
+      }
+      for (ssize_t done = 0; done < n;) {
+        ssize_t written = pwrite(out, &(*buf)[done], n - done, pos + done);
+        if (written < 0 && errno == EINTR) {
+          continue;
+        }
+        if (written < 0) {
+          return -errno;
+        }
+        done += written;
+      }
+      pos += n;
+    }
+    return 0;
+  }
+#endif
+};
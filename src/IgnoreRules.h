@@ -0,0 +1,219 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+// The patterns of a `.gitignore`-style ignore file, used to prune entries
+// during a traversal.
+//
+// Each directory's rules point to those of the nearest ancestor with any
+// rules, and rules in deeper directories take precedence, so checking an entry
+// only walks the directories which actually had ignore files. Paths are
+// relative to the root of the traversal, `base` is the directory the rules
+// were read from, e.g. "" for the root or "sub/" for a sub-directory.
+//
+// Like DirHandle, these never call into R.
+class IgnoreRules {
+public:
+  explicit IgnoreRules(const IgnoreRules* parent = NULL, const std::string& base = "")
+      : parent_(parent == NULL ? NULL : parent->active()), base_(base) {}
+
+  // Add the rule on a single line of an ignore file.
+  void add(std::string line) {
+    if (!line.empty() && line[line.size() - 1] == '\r') {
+      line.erase(line.size() - 1);
+    }
+    // Trailing spaces are ignored unless escaped.
+    size_t end = line.size();
+    while (end > 0 && line[end - 1] == ' ' &&
+           !(end > 1 && line[end - 2] == '\\')) {
+      --end;
+    }
+    line.erase(end);
+    if (line.empty() || line[0] == '#') {
+      return;
+    }
+
+    Rule rule;
+    rule.negate = line[0] == '!';
+    if (rule.negate) {
+      line.erase(0, 1);
+    } else if (line[0] == '\\' && line.size() > 1 &&
+               (line[1] == '!' || line[1] == '#')) {
+      line.erase(0, 1);
+    }
+    rule.dir_only = !line.empty() && line[line.size() - 1] == '/';
+    if (rule.dir_only) {
+      line.erase(line.size() - 1);
+    }
+    // Patterns with a slash are relative to the ignore file's directory,
+    // others match the name of an entry at any depth.
+    rule.anchored = line.find('/') != std::string::npos;
+    if (!line.empty() && line[0] == '/') {
+      line.erase(0, 1);
+    }
+    if (line.empty()) {
+      return;
+    }
+    rule.pattern = line;
+    rules_.push_back(rule);
+  }
+
+  // Add the rules in the contents of an ignore file.
+  void add_lines(const std::string& contents) {
+    size_t start = 0;
+    while (start < contents.size()) {
+      size_t end = contents.find('\n', start);
+      if (end == std::string::npos) {
+        end = contents.size();
+      }
+      add(contents.substr(start, end - start));
+      start = end + 1;
+    }
+  }
+
+  bool empty() const { return rules_.empty() && parent_ == NULL; }
+
+  // Whether the entry at `path`, relative to the root of the traversal, is
+  // ignored. `name` is its last component.
+  bool ignored(const std::string& path, const char* name, bool is_dir) const {
+    for (const IgnoreRules* r = active(); r != NULL; r = r->parent_) {
+      const char* rel = path.c_str() + r->base_.size();
+      for (size_t i = r->rules_.size(); i > 0; --i) {
+        const Rule& rule = r->rules_[i - 1];
+        if (rule.dir_only && !is_dir) {
+          continue;
+        }
+        const char* p = rule.pattern.c_str();
+        if (wildmatch(p, p, rule.anchored ? rel : name)) {
+          return !rule.negate;
+        }
+      }
+    }
+    return false;
+  }
+
+private:
+  struct Rule {
+    std::string pattern;
+    bool negate;
+    bool dir_only;
+    bool anchored;
+  };
+
+  const IgnoreRules* active() const {
+    return rules_.empty() ? parent_ : this;
+  }
+
+  // Match a bracket expression starting at `p` against `c`. Returns the end
+  // of the expression, or NULL if it is not terminated.
+  static const char* match_class(const char* p, char c, bool* matched) {
+    ++p;
+    bool negate = *p == '!' || *p == '^';
+    if (negate) {
+      ++p;
+    }
+    bool found = false;
+    bool first = true;
+    while (*p != '\0' && (*p != ']' || first)) {
+      first = false;
+      char lo = *p;
+      if (lo == '\\' && p[1] != '\0') {
+        lo = *++p;
+      }
+      char hi = lo;
+      if (p[1] == '-' && p[2] != '\0' && p[2] != ']') {
+        hi = p[2];
+        p += 2;
+        if (hi == '\\' && p[1] != '\0') {
+          hi = *++p;
+        }
+      }
+      if (c >= lo && c <= hi) {
+        found = true;
+      }
+      ++p;
+    }
+    if (*p != ']') {
+      return NULL;
+    }
+    *matched = found != negate && c != '/';
+    return p + 1;
+  }
+
+  // Match the whole of `s` against the pattern at `p`, where `pat` is the
+  // start of the pattern. '*', '?' and bracket expressions do not match '/',
+  // '**' between slashes matches any number of directories.
+  static bool wildmatch(const char* pat, const char* p, const char* s) {
+    while (*p != '\0') {
+      if (*p == '*') {
+        bool dstar = p[1] == '*' && (p == pat || p[-1] == '/');
+        while (*p == '*') {
+          ++p;
+        }
+        if (dstar && *p == '\0') {
+          return true;
+        }
+        if (dstar && *p == '/') {
+          ++p;
+          for (;;) {
+            if (wildmatch(pat, p, s)) {
+              return true;
+            }
+            const char* slash = strchr(s, '/');
+            if (slash == NULL) {
+              return false;
+            }
+            s = slash + 1;
+          }
+        }
+        for (;;) {
+          if (wildmatch(pat, p, s)) {
+            return true;
+          }
+          if (*s == '\0' || *s == '/') {
+            return false;
+          }
+          ++s;
+        }
+      }
+      if (*s == '\0') {
+        return false;
+      }
+      if (*p == '?') {
+        if (*s == '/') {
+          return false;
+        }
+      } else if (*p == '[') {
+        bool matched;
+        const char* end = match_class(p, *s, &matched);
+        if (end != NULL) {
+          if (!matched) {
+            return false;
+          }
+          p = end;
+          ++s;
+          continue;
+        }
+        if (*s != '[') {
+          return false;
+        }
+      } else {
+        if (*p == '\\' && p[1] != '\0') {
+          ++p;
+        }
+        if (*p != *s) {
+          return false;
+        }
+      }
+      ++p;
+      ++s;
+    }
+    return *s == '\0';
+  }
+
+  const IgnoreRules* parent_;
+  std::string base_;
+  std::vector<Rule> rules_;
+};
@@ -0,0 +1,337 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Runs batches of independent path operations through a Linux io_uring, so
+// many of them are in flight at once rather than one blocking system call per
+// path, which matters most on NVMe drives and network file systems.
+//
+// Like libuv, this does not need liburing or <linux/io_uring.h>: the kernel
+// structures are declared here and the system calls made directly. If
+// io_uring is not available, e.g. on older kernels, or disabled by a seccomp
+// filter or the `kernel.io_uring_disabled` sysctl, ok() is false and callers
+// use their usual code path. supports() says whether an operation is
+// implemented by the running kernel.
+//
+// Only available on Linux. This never calls into R, and a ring is only used
+// by one thread.
+class IoUring {
+public:
+  // The kernel's operation codes.
+  enum Op { STATX = 21, UNLINKAT = 36 };
+
+  // A single operation and, once run, its result: 0 or a negative errno.
+  // `path` is relative to the directory `dirfd`, which may be AT_FDCWD.
+  struct Request {
+    uint8_t op;
+    int dirfd;
+    const char* path;
+    int flags;
+    // For STATX, the fields requested and the `struct statx` they are read
+    // into.
+    unsigned int mask;
+    void* buf;
+    int res;
+  };
+
+  // A ring with `entries` submission queue entries, or none if 0.
+  explicit IoUring(unsigned int entries)
+      : fd_(-1), sq_(MAP_FAILED), sqes_(MAP_FAILED), sq_len_(0),
+        sqes_len_(0) {
+    memset(supported_, 0, sizeof(supported_));
+    setup(entries);
+  }
+
+  ~IoUring() {
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, sqes_len_);
+    }
+    if (sq_ != MAP_FAILED) {
+      munmap(sq_, sq_len_);
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  bool ok() const { return fd_ >= 0; }
+
+  bool supports(Op op) const { return ok() && supported_[op]; }
+
+  // Run `reqs`, setting the `res` of each. Requests which could not be run,
+  // because the ring failed, have `res` set to -ECANCELED.
+  //
+  // Every request submitted is reaped before this returns, so the kernel
+  // never writes to a request's buffer afterwards. If the ring fails it is
+  // closed, and ok() is false from then on.
+  void run(std::vector<Request>& reqs) {
+    size_t n = reqs.size();
+    size_t next = 0;
+    unsigned int in_flight = 0;
+    bool failed = false;
+
+    while (ok()) {
+      unsigned int tail = *sq_tail_;
+      // Completions can not overflow if there are never more requests in
+      // flight than completion entries.
+      while (!failed && next < n && in_flight < cq_entries_ &&
+             tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) <
+                 sq_entries_) {
+        prepare(&sqe(tail & sq_mask_), reqs[next], next);
+        ++tail;
+        ++next;
+        ++in_flight;
+      }
+      __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+      if (in_flight == 0) {
+        break;
+      }
+
+      unsigned int head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+      if (enter(failed ? 0 : tail - head, 1) < 0 && errno != EINTR &&
+          errno != EAGAIN && errno != EBUSY) {
+        if (!failed) {
+          // The entries the kernel has not consumed are withdrawn, they are
+          // only consumed by io_uring_enter(). Those it has are waited for.
+          failed = true;
+          head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+          in_flight -= tail - head;
+          __atomic_store_n(sq_tail_, head, __ATOMIC_RELEASE);
+        } else {
+          // Completions are still posted, and any task work run when this
+          // returns to user space.
+          usleep(1000);
+        }
+      }
+
+      unsigned int cq_head = *cq_head_;
+      unsigned int cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      while (cq_head != cq_tail) {
+        const Cqe& cqe = cqes_[cq_head & cq_mask_];
+        reqs[cqe.user_data].res = cqe.res;
+        ++cq_head;
+        --in_flight;
+      }
+      __atomic_store_n(cq_head_, cq_head, __ATOMIC_RELEASE);
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+      if (i >= next || (failed && reqs[i].res == 1)) {
+        reqs[i].res = -ECANCELED;
+      }
+    }
+    if (failed) {
+      fail();
+    }
+  }
+
+private:
+  IoUring(const IoUring&);
+  IoUring& operator=(const IoUring&);
+
+  struct SqringOffsets {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t ring_mask;
+    uint32_t ring_entries;
+    uint32_t flags;
+    uint32_t dropped;
+    uint32_t array;
+    uint32_t reserved0;
+    uint64_t reserved1;
+  };
+
+  struct CqringOffsets {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t ring_mask;
+    uint32_t ring_entries;
+    uint32_t overflow;
+    uint32_t cqes;
+    uint64_t reserved0;
+    uint64_t reserved1;
+  };
+
+  struct Params {
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    uint32_t flags;
+    uint32_t sq_thread_cpu;
+    uint32_t sq_thread_idle;
+    uint32_t features;
+    uint32_t reserved[4];
+    SqringOffsets sq_off;
+    CqringOffsets cq_off;
+  };
+
+  struct Sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t ioprio;
+    int32_t fd;
+    uint64_t off;
+    uint64_t addr;
+    uint32_t len;
+    uint32_t op_flags;
+    uint64_t user_data;
+    uint64_t pad[3];
+  };
+
+  struct Cqe {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+  };
+
+  struct ProbeOp {
+    uint8_t op;
+    uint8_t resv;
+    uint16_t flags;
+    uint32_t resv2;
+  };
+
+  struct Probe {
+    uint8_t last_op;
+    uint8_t ops_len;
+    uint16_t resv;
+    uint32_t resv2[3];
+    ProbeOp ops[256];
+  };
+
+  enum {
+    FEAT_SINGLE_MMAP = 1,
+    ENTER_GETEVENTS = 1,
+    REGISTER_PROBE = 8,
+    OP_SUPPORTED = 1
+  };
+
+  int fd_;
+  void* sq_;
+  void* sqes_;
+  size_t sq_len_;
+  size_t sqes_len_;
+  unsigned int* sq_head_;
+  unsigned int* sq_tail_;
+  unsigned int sq_mask_;
+  unsigned int sq_entries_;
+  unsigned int* cq_head_;
+  unsigned int* cq_tail_;
+  unsigned int cq_mask_;
+  unsigned int cq_entries_;
+  Cqe* cqes_;
+  bool supported_[256];
+
+  Sqe& sqe(unsigned int i) { return static_cast<Sqe*>(sqes_)[i]; }
+
+  static void prepare(Sqe* sqe, Request& req, size_t i) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req.op;
+    sqe->fd = req.dirfd;
+    sqe->addr = reinterpret_cast<uintptr_t>(req.path);
+    sqe->op_flags = req.flags;
+    sqe->user_data = i;
+    if (req.op == STATX) {
+      sqe->len = req.mask;
+      sqe->off = reinterpret_cast<uintptr_t>(req.buf);
+    }
+    // Marks the request as in flight.
+    req.res = 1;
+  }
+
+  int enter(unsigned int to_submit, unsigned int min_complete) {
+#ifdef __NR_io_uring_enter
+    return syscall(
+        __NR_io_uring_enter,
+        fd_,
+        to_submit,
+        min_complete,
+        ENTER_GETEVENTS,
+        NULL,
+        0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+  }
+
+  void setup(unsigned int entries) {
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_register)
+    if (entries == 0) {
+      return;
+    }
+    Params params;
+    memset(&params, 0, sizeof(params));
+    fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd_ < 0) {
+      fd_ = -1;
+      return;
+    }
+    if (!(params.features & FEAT_SINGLE_MMAP)) {
+      fail();
+      return;
+    }
+
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(Cqe);
+    sq_len_ = sq_len > cq_len ? sq_len : cq_len;
+    sqes_len_ = params.sq_entries * sizeof(Sqe);
+    sq_ = mmap(
+        0, sq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, 0);
+    sqes_ = mmap(
+        0,
+        sqes_len_,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        fd_,
+        0x10000000ull);
+    if (sq_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+      fail();
+      return;
+    }
+
+    char* base = static_cast<char*>(sq_);
+    sq_head_ = reinterpret_cast<unsigned int*>(base + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned int*>(base + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned int*>(base + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    cq_head_ = reinterpret_cast<unsigned int*>(base + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned int*>(base + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned int*>(base + params.cq_off.ring_mask);
+    cq_entries_ = params.cq_entries;
+    cqes_ = reinterpret_cast<Cqe*>(base + params.cq_off.cqes);
+
+    // Each submission queue slot always holds the entry of the same index.
+    uint32_t* array = reinterpret_cast<uint32_t*>(base + params.sq_off.array);
+    for (uint32_t i = 0; i < params.sq_entries; ++i) {
+      array[i] = i;
+    }
+
+    // Probing needs Linux 5.6, as does IORING_OP_STATX.
+    Probe probe;
+    memset(&probe, 0, sizeof(probe));
+    if (syscall(__NR_io_uring_register, fd_, REGISTER_PROBE, &probe, 256) < 0) {
+      fail();
+      return;
+    }
+    for (int i = 0; i < probe.ops_len; ++i) {
+      supported_[probe.ops[i].op] = probe.ops[i].flags & OP_SUPPORTED;
+    }
+#else
+    (void)entries;
+#endif
+  }
+
+  void fail() {
+    close(fd_);
+    fd_ = -1;
+  }
+};
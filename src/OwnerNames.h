@@ -0,0 +1,99 @@
+#pragma once
+
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS 1
+#endif
+
+#include <cerrno>
+#include <cstdio>
+#include <inttypes.h>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef __WIN32
+#include <grp.h>
+#include <pwd.h>
+#include <unistd.h>
+#endif
+
+// Resolves user and group ids to their names, or to the id as a string if
+// they have no name, as shown in the `user` and `group` columns of
+// `file_info()`.
+//
+// Lookups use the reentrant `getpwuid_r()` and `getgrgid_r()`. They can be
+// slow where users come from a directory service, so the names can be kept
+// for the rest of the session. The session store is only used from the main
+// thread.
+class OwnerNames {
+public:
+  static std::string user(uint64_t uid, bool session) {
+    return resolve(uid, false, session ? session_users() : NULL);
+  }
+
+  static std::string group(uint64_t gid, bool session) {
+    return resolve(gid, true, session ? session_groups() : NULL);
+  }
+
+private:
+  typedef std::map<uint64_t, std::string> Names;
+
+  static Names* session_users() {
+    static Names names;
+    return &names;
+  }
+
+  static Names* session_groups() {
+    static Names names;
+    return &names;
+  }
+
+  static std::string resolve(uint64_t id, bool is_group, Names* session) {
+    if (session == NULL) {
+      return lookup(id, is_group);
+    }
+    Names::iterator it = session->find(id);
+    if (it == session->end()) {
+      it = session->insert(std::make_pair(id, lookup(id, is_group))).first;
+    }
+    return it->second;
+  }
+
+  static std::string lookup(uint64_t id, bool is_group) {
+#ifndef __WIN32
+    long size = sysconf(is_group ? _SC_GETGR_R_SIZE_MAX : _SC_GETPW_R_SIZE_MAX);
+    std::vector<char> buf(size > 0 ? size : 1024);
+    for (;;) {
+      int res;
+      const char* name = NULL;
+      if (is_group) {
+        struct group grp;
+        struct group* result = NULL;
+        res = getgrgid_r(id, &grp, &buf[0], buf.size(), &result);
+        if (res == 0 && result != NULL) {
+          name = result->gr_name;
+        }
+      } else {
+        struct passwd pwd;
+        struct passwd* result = NULL;
+        res = getpwuid_r(id, &pwd, &buf[0], buf.size(), &result);
+        if (res == 0 && result != NULL) {
+          name = result->pw_name;
+        }
+      }
+      if (name != NULL) {
+        return name;
+      }
+      // Entries larger than the suggested size need a larger buffer.
+      if (res != ERANGE || buf.size() >= 1 << 20) {
+        break;
+      }
+      buf.resize(buf.size() * 2);
+    }
+#endif
+    char id_buf[20];
+    snprintf(id_buf, sizeof(id_buf), "%" PRIu64, id);
+    return id_buf;
+  }
+};
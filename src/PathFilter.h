@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cctype>
+#include <cstring>
+#include <string>
+
+#ifndef __WIN32
+#include <regex.h>
+#endif
+
+// Matches paths against a pattern like `path_filter()` does with `grep()`, so
+// entries can be filtered while a directory is traversed, rather than listing
+// every entry into R first.
+//
+// Globs use the semantics of `utils::glob2rx()`: '*' matches any sequence of
+// characters, '?' matches a single character, and the whole path must match.
+// Regular expressions are POSIX extended regular expressions, and are not
+// available on Windows. Matching never calls into R.
+class PathFilter {
+public:
+  enum Type { NONE, GLOB, REGEXP, FIXED };
+
+  PathFilter()
+      : type_(NONE), icase_(false), invert_(false), utf8_(false),
+        compiled_(false) {}
+
+  ~PathFilter() {
+#ifndef __WIN32
+    if (compiled_) {
+      regfree(&regex_);
+    }
+#endif
+  }
+
+  // Returns false and sets `error` if `pattern` is not a valid regular
+  // expression.
+  bool set(
+      Type type,
+      const std::string& pattern,
+      bool icase,
+      bool invert,
+      bool utf8,
+      std::string* error) {
+    type_ = type;
+    pattern_ = pattern;
+    icase_ = icase;
+    invert_ = invert;
+    utf8_ = utf8;
+    if (type_ != REGEXP) {
+      return true;
+    }
+#ifndef __WIN32
+    int flags = REG_EXTENDED | REG_NOSUB | (icase_ ? REG_ICASE : 0);
+    int res = regcomp(&regex_, pattern_.c_str(), flags);
+    if (res != 0) {
+      char buf[256];
+      regerror(res, &regex_, buf, sizeof(buf));
+      *error = buf;
+      return false;
+    }
+    compiled_ = true;
+    return true;
+#else
+    *error = "regular expressions are not supported";
+    return false;
+#endif
+  }
+
+  bool matches(const char* path) const {
+    bool res = true;
+    switch (type_) {
+    case NONE:
+      return true;
+    case GLOB:
+      res = glob_matches(pattern_.c_str(), path);
+      break;
+    case FIXED:
+      res = strstr(path, pattern_.c_str()) != NULL;
+      break;
+    case REGEXP:
+#ifndef __WIN32
+      res = regexec(&regex_, path, 0, NULL, 0) == 0;
+#endif
+      break;
+    }
+    return res != invert_;
+  }
+
+private:
+  PathFilter(const PathFilter&);
+  PathFilter& operator=(const PathFilter&);
+
+  // The start of the character after the one at `s`.
+  const char* next_char(const char* s) const {
+    ++s;
+    if (utf8_) {
+      while ((*s & 0xC0) == 0x80) {
+        ++s;
+      }
+    }
+    return s;
+  }
+
+  bool chars_equal(char x, char y) const {
+    if (icase_ && !(x & 0x80) && !(y & 0x80)) {
+      return tolower(x) == tolower(y);
+    }
+    return x == y;
+  }
+
+  // Matches the whole of `s`, backtracking to the last '*' on a mismatch.
+  bool glob_matches(const char* p, const char* s) const {
+    const char* star = NULL;
+    const char* mark = NULL;
+    while (*s != '\0') {
+      if (*p == '*') {
+        star = ++p;
+        mark = s;
+      } else if (*p == '?') {
+        ++p;
+        s = next_char(s);
+      } else if (*p != '\0' && chars_equal(*p, *s)) {
+        ++p;
+        ++s;
+      } else if (star != NULL) {
+        p = star;
+        mark = next_char(mark);
+        s = mark;
+      } else {
+        return false;
+      }
+    }
+    while (*p == '*') {
+      ++p;
+    }
+    return *p == '\0';
+  }
+
+  Type type_;
+  std::string pattern_;
+  bool icase_;
+  bool invert_;
+  bool utf8_;
+  bool compiled_;
+#ifndef __WIN32
+  regex_t regex_;
+#endif
+};
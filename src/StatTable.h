@@ -0,0 +1,329 @@
+#pragma once
+
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS 1
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <inttypes.h>
+#include <map>
+#include <sys/stat.h>
+
+#include <R.h>
+#include <Rinternals.h>
+
+#include "uv.h"
+
+#include "OwnerNames.h"
+
+#undef ERROR
+
+// Collects the results of stat calls into the columns of the data frame
+// returned by `file_info()`, one row per path. Rows without a stat result are
+// all NA apart from the path.
+//
+// The columns are grown in place, so the table is always the same list, which
+// the caller protects, e.g. with `PROTECT(table.data())`.
+//
+// A table can be limited to some of the columns, in which case only those are
+// allocated and filled. The `path` column is always included.
+//
+// Each distinct owner is only resolved once per table, and every row with
+// that owner shares the same CHARSXP. The CHARSXPs are protected by the rows
+// they were first set in. If `session` is true the names are also reused
+// between tables, see OwnerNames.
+class StatTable {
+public:
+  enum Column {
+    PATH,
+    DEVICE_ID,
+    TYPE,
+    PERMISSIONS,
+    HARD_LINKS,
+    USER,
+    GROUP,
+    SPECIAL_DEVICE_ID,
+    INODE,
+    SIZE,
+    BLOCK_SIZE,
+    BLOCKS,
+    FLAGS,
+    GENERATION,
+    ACCESS_TIME,
+    MODIFICATION_TIME,
+    CHANGE_TIME,
+    BIRTH_TIME,
+    N_COLUMNS
+  };
+
+  // A set of columns, with a bit for each Column.
+  typedef unsigned int Columns;
+
+  static const Columns ALL_COLUMNS = (1u << N_COLUMNS) - 1;
+
+  explicit StatTable(
+      R_xlen_t size = 1, bool session = false, Columns columns = ALL_COLUMNS)
+      : n_(0), session_(session) {
+    static const SEXPTYPE types[N_COLUMNS] = {
+        STRSXP,  REALSXP, INTSXP,  INTSXP,  REALSXP, STRSXP,
+        STRSXP,  REALSXP, REALSXP, REALSXP, REALSXP, REALSXP,
+        INTSXP,  REALSXP, REALSXP, REALSXP, REALSXP, REALSXP};
+    if (size < 1) {
+      size = 1;
+    }
+    columns |= 1u << PATH;
+    int n_columns = 0;
+    for (int j = 0; j < N_COLUMNS; ++j) {
+      index_[j] = columns & (1u << j) ? n_columns++ : -1;
+    }
+    data_ = PROTECT(Rf_allocVector(VECSXP, n_columns));
+    for (int j = 0; j < N_COLUMNS; ++j) {
+      if (has(static_cast<Column>(j))) {
+        SET_VECTOR_ELT(data_, index_[j], Rf_allocVector(types[j], size));
+      }
+    }
+    UNPROTECT(1);
+  }
+
+  // The columns named in `names`, a character vector, or all of them if it is
+  // NULL.
+  static Columns parse_columns(SEXP names) {
+    if (Rf_isNull(names)) {
+      return ALL_COLUMNS;
+    }
+    Columns columns = 0;
+    for (R_xlen_t i = 0; i < Rf_xlength(names); ++i) {
+      const char* name = CHAR(STRING_ELT(names, i));
+      int j = 0;
+      while (j < N_COLUMNS && strcmp(name, column_name(j)) != 0) {
+        ++j;
+      }
+      if (j == N_COLUMNS) {
+        Rf_error("Unknown `file_info()` field '%s'", name);
+      }
+      columns |= 1u << j;
+    }
+    return columns;
+  }
+
+  bool has(Column j) const { return index_[j] >= 0; }
+
+  // The code of the file type in `mode` in the `type` column, the values of
+  // `file_types` in R.
+  static int type_code(uint64_t mode) {
+    switch (mode & S_IFMT) {
+    case S_IFBLK:
+      return 0;
+    case S_IFCHR:
+      return 1;
+    case S_IFDIR:
+      return 2;
+    case S_IFIFO:
+      return 3;
+    case S_IFLNK:
+      return 4;
+    case S_IFREG:
+      return 5;
+#ifndef __WIN32
+    case S_IFSOCK:
+      return 6;
+#endif
+    default:
+      return NA_INTEGER;
+    }
+  }
+
+  SEXP data() const { return data_; }
+
+  // Add a row for `path`, a CHARSXP. If `st` is NULL the row is NA.
+  void push_back(SEXP path, const uv_stat_t* st) {
+    if (Rf_xlength(column(PATH)) == n_) {
+      PROTECT(path);
+      resize(n_ * 2);
+      UNPROTECT(1);
+    }
+    R_xlen_t i = n_++;
+    SET_STRING_ELT(column(PATH), i, path);
+    if (st == NULL) {
+      set_na(i);
+    } else {
+      set(i, *st);
+    }
+  }
+
+  R_xlen_t size() const { return n_; }
+
+  // The data frame of the rows added so far.
+  operator SEXP() {
+    if (Rf_xlength(column(PATH)) != n_) {
+      resize(n_);
+    }
+
+    SEXP names_sxp = PROTECT(Rf_allocVector(STRSXP, Rf_xlength(data_)));
+    for (int j = 0; j < N_COLUMNS; ++j) {
+      if (has(static_cast<Column>(j))) {
+        SET_STRING_ELT(names_sxp, index_[j], Rf_mkChar(column_name(j)));
+      }
+    }
+    Rf_setAttrib(data_, R_NamesSymbol, names_sxp);
+    UNPROTECT(1);
+
+    if (has(PERMISSIONS)) {
+      set_class(column(PERMISSIONS), "fs_perms", "integer");
+    }
+    if (has(SIZE)) {
+      set_class(column(SIZE), "fs_bytes", "numeric");
+    }
+
+    Rf_setAttrib(data_, R_ClassSymbol, Rf_mkString("data.frame"));
+
+    SEXP row_names = PROTECT(Rf_allocVector(INTSXP, 2));
+    INTEGER(row_names)[0] = NA_INTEGER;
+    INTEGER(row_names)[1] = -n_;
+    Rf_setAttrib(data_, R_RowNamesSymbol, row_names);
+    UNPROTECT(1);
+
+    return data_;
+  }
+
+private:
+  SEXP data_;
+  R_xlen_t n_;
+  bool session_;
+  // The position of each column in `data_`, or -1 if it is not included.
+  int index_[N_COLUMNS];
+  std::map<uint64_t, SEXP> users_;
+  std::map<uint64_t, SEXP> groups_;
+
+  StatTable(const StatTable&);
+  StatTable& operator=(const StatTable&);
+
+  static const char* column_name(int j) {
+    static const char* names[N_COLUMNS] = {
+        "path",
+        "device_id",
+        "type",
+        "permissions",
+        "hard_links",
+        "user",
+        "group",
+        "special_device_id",
+        "inode",
+        "size",
+        "block_size",
+        "blocks",
+        "flags",
+        "generation",
+        "access_time",
+        "modification_time",
+        "change_time",
+        "birth_time"};
+    return names[j];
+  }
+
+  SEXP column(Column j) const { return VECTOR_ELT(data_, index_[j]); }
+
+  // The columns are reachable from `data_` while the new ones are allocated.
+  void resize(R_xlen_t size) {
+    for (R_xlen_t j = 0; j < Rf_xlength(data_); ++j) {
+      SET_VECTOR_ELT(data_, j, Rf_xlengthgets(VECTOR_ELT(data_, j), size));
+    }
+  }
+
+  static void set_class(SEXP x, const char* cls, const char* base) {
+    SEXP class_sxp = PROTECT(Rf_allocVector(STRSXP, 2));
+    SET_STRING_ELT(class_sxp, 0, Rf_mkChar(cls));
+    SET_STRING_ELT(class_sxp, 1, Rf_mkChar(base));
+    Rf_classgets(x, class_sxp);
+    UNPROTECT(1);
+  }
+
+  void set_real(Column j, R_xlen_t i, double value) {
+    if (has(j)) {
+      REAL(column(j))[i] = value;
+    }
+  }
+
+  void set_integer(Column j, R_xlen_t i, int value) {
+    if (has(j)) {
+      INTEGER(column(j))[i] = value;
+    }
+  }
+
+  void set_time(Column j, R_xlen_t i, const uv_timespec_t& ts) {
+    set_real(j, i, ts.tv_sec + 1e-9 * ts.tv_nsec);
+  }
+
+  void set_na(R_xlen_t i) {
+    for (int j = 0; j < N_COLUMNS; ++j) {
+      Column col = static_cast<Column>(j);
+      if (col == PATH || !has(col)) {
+        continue;
+      }
+      SEXP x = column(col);
+      switch (TYPEOF(x)) {
+      case STRSXP:
+        SET_STRING_ELT(x, i, NA_STRING);
+        break;
+      case INTSXP:
+        INTEGER(x)[i] = NA_INTEGER;
+        break;
+      default:
+        REAL(x)[i] = NA_REAL;
+        break;
+      }
+    }
+  }
+
+  // The name of a user or group as a CHARSXP. It must be set in a row before
+  // anything else is allocated.
+  SEXP owner(uint64_t id, bool is_group) {
+    std::map<uint64_t, SEXP>& chars = is_group ? groups_ : users_;
+    std::map<uint64_t, SEXP>::iterator it = chars.find(id);
+    if (it != chars.end()) {
+      return it->second;
+    }
+    std::string name = is_group ? OwnerNames::group(id, session_)
+                                : OwnerNames::user(id, session_);
+    SEXP name_sxp = Rf_mkCharCE(name.c_str(), CE_UTF8);
+    chars[id] = name_sxp;
+    return name_sxp;
+  }
+
+  void set(R_xlen_t i, const uv_stat_t& st) {
+    set_real(DEVICE_ID, i, st.st_dev);
+    set_integer(TYPE, i, type_code(st.st_mode));
+    set_integer(PERMISSIONS, i, st.st_mode);
+    set_real(HARD_LINKS, i, st.st_nlink);
+
+#ifdef __WIN32
+    if (has(USER)) {
+      SET_STRING_ELT(column(USER), i, NA_STRING);
+    }
+    if (has(GROUP)) {
+      SET_STRING_ELT(column(GROUP), i, NA_STRING);
+    }
+#else
+    if (has(USER)) {
+      SET_STRING_ELT(column(USER), i, owner(st.st_uid, false));
+    }
+    if (has(GROUP)) {
+      SET_STRING_ELT(column(GROUP), i, owner(st.st_gid, true));
+    }
+#endif
+
+    set_real(SPECIAL_DEVICE_ID, i, st.st_rdev);
+    set_real(INODE, i, st.st_ino);
+    set_real(SIZE, i, st.st_size);
+    set_real(BLOCK_SIZE, i, st.st_blksize);
+    set_real(BLOCKS, i, st.st_blocks);
+    set_integer(FLAGS, i, st.st_flags);
+    set_real(GENERATION, i, st.st_gen);
+
+    set_time(ACCESS_TIME, i, st.st_atim);
+    set_time(MODIFICATION_TIME, i, st.st_mtim);
+    set_time(CHANGE_TIME, i, st.st_ctim);
+    set_time(BIRTH_TIME, i, st.st_birthtim);
+  }
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "uv.h"
+
+// A small pool of worker threads built on the libuv thread primitives.
+//
+// Tasks are taken from a shared stack, so tasks which push more tasks (e.g.
+// one per sub-directory) are processed roughly depth first, which keeps the
+// amount of queued work bounded. The thread calling `wait()` also runs tasks,
+// so a pool with `threads = 1` runs everything on the calling thread.
+//
+// Tasks run on worker threads and so must never call into R.
+class ThreadPool {
+public:
+  class Task {
+  public:
+    virtual ~Task() {}
+    virtual void run(ThreadPool& pool) = 0;
+  };
+
+  explicit ThreadPool(int threads) : active_(0), stop_(false), cancel_(false) {
+    uv_mutex_init(&mutex_);
+    uv_cond_init(&cond_);
+    for (int i = 1; i < threads; ++i) {
+      uv_thread_t tid;
+      if (uv_thread_create(&tid, worker, this) != 0) {
+        break;
+      }
+      threads_.push_back(tid);
+    }
+  }
+
+  ~ThreadPool() {
+    uv_mutex_lock(&mutex_);
+    stop_ = true;
+    uv_cond_broadcast(&cond_);
+    uv_mutex_unlock(&mutex_);
+
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      uv_thread_join(&threads_[i]);
+    }
+    for (size_t i = 0; i < tasks_.size(); ++i) {
+      delete tasks_[i];
+    }
+    uv_cond_destroy(&cond_);
+    uv_mutex_destroy(&mutex_);
+  }
+
+  // Takes ownership of `task`, tasks pushed after `cancel()` are dropped.
+  void push(Task* task) {
+    uv_mutex_lock(&mutex_);
+    if (cancel_) {
+      uv_mutex_unlock(&mutex_);
+      delete task;
+      return;
+    }
+    tasks_.push_back(task);
+    uv_cond_signal(&cond_);
+    uv_mutex_unlock(&mutex_);
+  }
+
+  // Run tasks on the calling thread until all tasks have finished.
+  void wait() {
+    uv_mutex_lock(&mutex_);
+    while (!tasks_.empty() || active_ > 0) {
+      if (tasks_.empty()) {
+        uv_cond_wait(&cond_, &mutex_);
+        continue;
+      }
+      run_one();
+    }
+    uv_mutex_unlock(&mutex_);
+  }
+
+  // Drop all pending tasks, tasks which are already running still finish.
+  void cancel() {
+    uv_mutex_lock(&mutex_);
+    cancel_ = true;
+    for (size_t i = 0; i < tasks_.size(); ++i) {
+      delete tasks_[i];
+    }
+    tasks_.clear();
+    uv_cond_broadcast(&cond_);
+    uv_mutex_unlock(&mutex_);
+  }
+
+  // The message of the first exception thrown by a task, if any.
+  const std::string& error() const { return error_; }
+
+private:
+  ThreadPool(const ThreadPool&);
+  ThreadPool& operator=(const ThreadPool&);
+
+  // Called with the mutex held, returns with it held.
+  void run_one() {
+    Task* task = tasks_.back();
+    tasks_.pop_back();
+    ++active_;
+    uv_mutex_unlock(&mutex_);
+
+    std::string error;
+    try {
+      task->run(*this);
+    } catch (std::exception& e) {
+      error = e.what();
+    }
+    delete task;
+
+    if (!error.empty()) {
+      cancel();
+    }
+
+    uv_mutex_lock(&mutex_);
+    if (!error.empty() && error_.empty()) {
+      error_ = error;
+    }
+    --active_;
+    if (tasks_.empty() && active_ == 0) {
+      uv_cond_broadcast(&cond_);
+    }
+  }
+
+  static void worker(void* data) {
+    ThreadPool* pool = static_cast<ThreadPool*>(data);
+    uv_mutex_lock(&pool->mutex_);
+    while (!pool->stop_) {
+      if (pool->tasks_.empty()) {
+        uv_cond_wait(&pool->cond_, &pool->mutex_);
+        continue;
+      }
+      pool->run_one();
+    }
+    uv_mutex_unlock(&pool->mutex_);
+  }
+
+  std::vector<uv_thread_t> threads_;
+  std::vector<Task*> tasks_;
+  uv_mutex_t mutex_;
+  uv_cond_t cond_;
+  int active_;
+  bool stop_;
+  bool cancel_;
+  std::string error_;
+};
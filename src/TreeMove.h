@@ -0,0 +1,599 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef __WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "uv.h"
+
+#include "DirHandle.h"
+#include "FileCopy.h"
+#include "ThreadPool.h"
+
+// The number of files moved by each task of a tree move.
+#define MOVE_BATCH_SIZE 64
+
+// Moves a file or a directory tree to another file system, where it cannot
+// simply be renamed, for `file_move()`.
+//
+// Files are copied with FileCopy on the thread pool, a batch at a time, and
+// are given the owner (where permitted), mode and times of the original. Each
+// original is only removed once its copy has been verified, and only if its
+// size and modification time are unchanged, so nothing written to it during
+// the move is lost. Each directory is read by its own task, so independent
+// sub-trees are moved concurrently. A directory is given its metadata and the
+// original removed as soon as everything in it has been moved.
+//
+// As with a rename, a directory can only replace an empty directory, and
+// anything else can replace anything but a directory. This is checked before
+// anything is moved. Files with several hard links in the tree are copied
+// once, and linked to at the others, by their device and inode. Links to files
+// moved before an interrupted move was resumed are copied separately.
+//
+// Trees are moved into a staging directory next to the destination, which is
+// renamed to it once complete, so the destination only appears when the move
+// has finished. If a move is interrupted everything left at the source still
+// has to be moved, and moving it again resumes the move, replacing any
+// partial copies in the staging directory. Once the source has been removed
+// the staging directory is first given a distinct name, so only a complete
+// copy is renamed to the destination when a move is resumed without a source.
+//
+// This never calls into R. The first error cancels the remaining tasks and is
+// returned by `run()`, with the arguments of its message in `error()`.
+class TreeMove {
+public:
+  // An error and the arguments of its message.
+  struct Error {
+    int err;
+    const char* format;
+    std::string one;
+    std::string two;
+  };
+
+  explicit TreeMove(int threads)
+      : threads_(threads), pool_(NULL), linked_(false) {
+    uv_mutex_init(&mutex_);
+    uv_mutex_init(&links_mutex_);
+    error_.err = 0;
+    error_.format = NULL;
+  }
+
+  ~TreeMove() {
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      delete nodes_[i];
+    }
+    uv_mutex_destroy(&links_mutex_);
+    uv_mutex_destroy(&mutex_);
+  }
+
+  // Whether a move of a directory to `to` was interrupted after its source
+  // was removed, so only the complete copy is left to be renamed.
+  static bool resumable(const std::string& to) {
+    uv_dirent_type_t type;
+    return lstat_dirent_type(staging_path(to, true).c_str(), &type) == 0 &&
+           type == UV_DIRENT_DIR;
+  }
+
+  // Move `from` to `to`, returning 0 or a libuv error code.
+  int run(const std::string& from, const std::string& to) {
+    std::string staging = staging_path(to, false);
+    complete_ = staging_path(to, true);
+    uv_stat_t st;
+    int err = lstat(from, &st);
+    if (err == UV_ENOENT && resumable(to)) {
+      return finish(complete_, to);
+    }
+    if (err < 0) {
+      return fail(err, "Failed to stat '%s'", from, "");
+    }
+    bool is_dir = mode_dirent_type(st.st_mode) == UV_DIRENT_DIR;
+    err = check_destination(to, is_dir);
+    if (err < 0) {
+      return fail(err, "Failed to move '%s' to '%s'", from, to);
+    }
+    if (!is_dir) {
+      return move_entry(from, to, st);
+    }
+
+    err = make_dir(staging);
+    if (err < 0) {
+      return fail(err, "Failed to make directory '%s'", staging, "");
+    }
+
+    // Initialize the default loop before any worker thread uses it.
+    uv_default_loop();
+    ThreadPool pool(threads_);
+    pool_ = &pool;
+    push(from, staging, st, NULL);
+    pool.wait();
+    pool_ = NULL;
+
+    if (error_.err < 0) {
+      return error_.err;
+    }
+    return finish(complete_, to);
+  }
+
+  const Error& error() const { return error_; }
+
+private:
+  // A directory being moved. `pending` counts the tasks and sub-directories
+  // of it which are not finished yet.
+  struct Node {
+    std::string from;
+    std::string to;
+    uv_stat_t st;
+    Node* parent;
+    int pending;
+  };
+
+  // A file to move.
+  struct Job {
+    std::string from;
+    std::string to;
+    uv_stat_t st;
+  };
+
+  class ReadTask : public ThreadPool::Task {
+    TreeMove* move_;
+    Node* node_;
+
+  public:
+    ReadTask(TreeMove* move, Node* node) : move_(move), node_(node) {}
+
+    void run(ThreadPool&) { move_->read(node_); }
+  };
+
+  class FilesTask : public ThreadPool::Task {
+    TreeMove* move_;
+    Node* node_;
+    std::vector<Job> jobs_;
+
+  public:
+    FilesTask(TreeMove* move, Node* node, std::vector<Job>* jobs)
+        : move_(move), node_(node) {
+      jobs_.swap(*jobs);
+    }
+
+    void run(ThreadPool&) { move_->move_files(node_, jobs_); }
+  };
+
+  int threads_;
+  ThreadPool* pool_;
+  uv_mutex_t mutex_;
+  std::vector<Node*> nodes_;
+  Error error_;
+  // The name of the staging directory once the source is removed.
+  std::string complete_;
+  // The copies of files with several links, by the device and inode of the
+  // original, which are only moved while `links_mutex_` is held. `linked_` is
+  // set once there are any.
+  uv_mutex_t links_mutex_;
+  std::map<std::pair<uint64_t, uint64_t>, std::string> links_;
+  bool linked_;
+
+  TreeMove(const TreeMove&);
+  TreeMove& operator=(const TreeMove&);
+
+  // The staging directory of `to`, a hidden sibling of it, or its name once
+  // the copy is `complete`.
+  static std::string staging_path(const std::string& to, bool complete) {
+    const char* suffix = complete ? ".fs_moved" : ".fs_move";
+    std::string path = to;
+    while (path.size() > 1 && path[path.size() - 1] == '/') {
+      path.erase(path.size() - 1);
+    }
+    size_t slash = path.find_last_of('/');
+    if (slash == std::string::npos) {
+      return '.' + path + suffix;
+    }
+    return path.substr(0, slash + 1) + '.' + path.substr(slash + 1) + suffix;
+  }
+
+  static int lstat(const std::string& path, uv_stat_t* st) {
+    uv_fs_t req;
+    int err = uv_fs_lstat(uv_default_loop(), &req, path.c_str(), NULL);
+    *st = req.statbuf;
+    uv_fs_req_cleanup(&req);
+    return err;
+  }
+
+  void push(
+      const std::string& from,
+      const std::string& to,
+      const uv_stat_t& st,
+      Node* parent) {
+    Node* node = new Node;
+    node->from = from;
+    node->to = to;
+    node->st = st;
+    node->parent = parent;
+    node->pending = 1;
+    if (parent != NULL) {
+      __atomic_add_fetch(&parent->pending, 1, __ATOMIC_ACQ_REL);
+    }
+    uv_mutex_lock(&mutex_);
+    nodes_.push_back(node);
+    uv_mutex_unlock(&mutex_);
+    pool_->push(new ReadTask(this, node));
+  }
+
+  bool failed() {
+    uv_mutex_lock(&mutex_);
+    bool failed = error_.err != 0;
+    uv_mutex_unlock(&mutex_);
+    return failed;
+  }
+
+  int fail(
+      int err,
+      const char* format,
+      const std::string& one,
+      const std::string& two) {
+    uv_mutex_lock(&mutex_);
+    if (error_.err == 0) {
+      error_.err = err;
+      error_.format = format;
+      error_.one = one;
+      error_.two = two;
+    }
+    uv_mutex_unlock(&mutex_);
+    if (pool_ != NULL) {
+      pool_->cancel();
+    }
+    return err;
+  }
+
+  // Check that `to` can be replaced by a move, returning UV_ENOTEMPTY,
+  // UV_ENOTDIR or UV_EISDIR, as a rename would, if not.
+  static int check_destination(const std::string& to, bool is_dir) {
+    uv_stat_t st;
+    int err = lstat(to, &st);
+    if (err == UV_ENOENT) {
+      return 0;
+    }
+    if (err < 0) {
+      return err;
+    }
+    bool to_dir = mode_dirent_type(st.st_mode) == UV_DIRENT_DIR;
+    if (!is_dir) {
+      return to_dir ? UV_EISDIR : 0;
+    }
+    if (!to_dir) {
+      return UV_ENOTDIR;
+    }
+    DirHandle dir;
+    std::vector<DirEntry> entries;
+    err = dir.open(to);
+    if (err == 0) {
+      err = dir.next(true, &entries, 1);
+    }
+    if (err < 0) {
+      return err;
+    }
+    return entries.empty() ? 0 : UV_ENOTEMPTY;
+  }
+
+  int finish(const std::string& staging, const std::string& to) {
+    uv_fs_t req;
+    int err = uv_fs_rename(
+        uv_default_loop(), &req, staging.c_str(), to.c_str(), NULL);
+    uv_fs_req_cleanup(&req);
+    if (err < 0) {
+      return fail(err, "Failed to move '%s' to '%s'", staging, to);
+    }
+    return 0;
+  }
+
+  // Create the directory `path`, which succeeds if it already exists from an
+  // interrupted move. It is only writable by the owner until it gets the
+  // mode of the original.
+  static int make_dir(const std::string& path) {
+    uv_fs_t req;
+    int err = uv_fs_mkdir(uv_default_loop(), &req, path.c_str(), 0700, NULL);
+    uv_fs_req_cleanup(&req);
+    uv_dirent_type_t type;
+    if (err == UV_EEXIST && lstat_dirent_type(path.c_str(), &type) == 0 &&
+        type == UV_DIRENT_DIR) {
+      return 0;
+    }
+    return err;
+  }
+
+  // Give `path` the owner, if permitted, mode and times in `st`.
+  static int set_metadata(const std::string& path, const uv_stat_t& st) {
+#ifndef __WIN32
+    const char* p = path.c_str();
+    bool is_link = S_ISLNK(st.st_mode);
+    if (lchown(p, st.st_uid, st.st_gid) != 0 && errno != EPERM) {
+      return -errno;
+    }
+    // Changing the owner may clear the setuid and setgid bits, which the
+    // copies of files otherwise already have.
+    bool set_mode =
+        S_ISDIR(st.st_mode) || (!is_link && (st.st_mode & (S_ISUID | S_ISGID)));
+    if (set_mode && chmod(p, st.st_mode & 07777) != 0) {
+      return -errno;
+    }
+    return FileCopy::set_times(p, st);
+#else
+    int err = 0;
+    if (mode_dirent_type(st.st_mode) == UV_DIRENT_DIR) {
+      uv_fs_t req;
+      err = uv_fs_chmod(
+          uv_default_loop(), &req, path.c_str(), st.st_mode & 0777, NULL);
+      uv_fs_req_cleanup(&req);
+    }
+    if (err == 0) {
+      err = FileCopy::set_times(path.c_str(), st);
+    }
+    return err;
+#endif
+  }
+
+  // Recreate the link `from` at `to`, replacing any existing link.
+  static int copy_link(const std::string& from, const std::string& to) {
+    uv_fs_t req;
+    int err = uv_fs_readlink(uv_default_loop(), &req, from.c_str(), NULL);
+    if (err < 0) {
+      uv_fs_req_cleanup(&req);
+      return err;
+    }
+    std::string target(static_cast<const char*>(req.ptr));
+    uv_fs_req_cleanup(&req);
+
+    uv_fs_unlink(uv_default_loop(), &req, to.c_str(), NULL);
+    uv_fs_req_cleanup(&req);
+    int flags = 0;
+#ifdef __WIN32
+    flags = UV_FS_SYMLINK_JUNCTION;
+#endif
+    err = uv_fs_symlink(
+        uv_default_loop(), &req, target.c_str(), to.c_str(), flags, NULL);
+    uv_fs_req_cleanup(&req);
+    return err;
+  }
+
+  // Move anything but a directory, with the stat result `st` of `from`.
+  int
+  move_entry(const std::string& from, const std::string& to, uv_stat_t st) {
+    // Any partial copy from an interrupted move is replaced, even if it is
+    // read-only.
+    uv_fs_t req;
+    uv_fs_unlink(uv_default_loop(), &req, to.c_str(), NULL);
+    uv_fs_req_cleanup(&req);
+
+    int err;
+    switch (mode_dirent_type(st.st_mode)) {
+    case UV_DIRENT_LINK:
+      err = copy_link(from, to);
+      break;
+    case UV_DIRENT_FILE:
+      err = FileCopy::copy(from.c_str(), to.c_str(), false, FileCopy::AUTO);
+      break;
+    default:
+#ifndef __WIN32
+      // FIFOs, sockets and devices are recreated rather than read.
+      err = mknod(to.c_str(), st.st_mode, st.st_rdev) == 0 ? 0 : -errno;
+#else
+      err = UV_ENOTSUP;
+#endif
+      break;
+    }
+    if (err == 0) {
+      err = set_metadata(to, st);
+    }
+    if (err < 0) {
+      return fail(err, "Failed to copy '%s' to '%s'", from, to);
+    }
+
+    err = verify(from, to, st);
+    if (err < 0) {
+      return fail(err, "Failed to verify the copy of '%s' at '%s'", from, to);
+    }
+
+    return remove_entry(from);
+  }
+
+  // Move a file which may have several links, by linking to the copy of
+  // another link to it if there is one. Its other links may have been moved
+  // since it was stat'ed, so even a file with one link is looked up once any
+  // have been copied.
+  int move_file(const Job& job) {
+    bool several = job.st.st_nlink > 1;
+    if (!several && !__atomic_load_n(&linked_, __ATOMIC_ACQUIRE)) {
+      return move_entry(job.from, job.to, job.st);
+    }
+    std::pair<uint64_t, uint64_t> key(job.st.st_dev, job.st.st_ino);
+    uv_mutex_lock(&links_mutex_);
+    int err;
+    std::map<std::pair<uint64_t, uint64_t>, std::string>::iterator it =
+        links_.find(key);
+    if (it != links_.end()) {
+      err = link_entry(job.from, it->second, job.to, job.st);
+    } else if (several) {
+      err = move_entry(job.from, job.to, job.st);
+      if (err == 0) {
+        links_[key] = job.to;
+        __atomic_store_n(&linked_, true, __ATOMIC_RELEASE);
+      }
+    } else {
+      uv_mutex_unlock(&links_mutex_);
+      return move_entry(job.from, job.to, job.st);
+    }
+    uv_mutex_unlock(&links_mutex_);
+    return err;
+  }
+
+  // Move `from`, with the stat result `st`, by linking `to` to `copy`, an
+  // existing copy of another link to it.
+  int link_entry(
+      const std::string& from,
+      const std::string& copy,
+      const std::string& to,
+      const uv_stat_t& st) {
+    uv_fs_t req;
+    uv_fs_unlink(uv_default_loop(), &req, to.c_str(), NULL);
+    uv_fs_req_cleanup(&req);
+    int err =
+        uv_fs_link(uv_default_loop(), &req, copy.c_str(), to.c_str(), NULL);
+    uv_fs_req_cleanup(&req);
+    if (err < 0) {
+      return fail(err, "Failed to link '%s' to '%s'", copy, to);
+    }
+
+    err = verify(from, to, st);
+    if (err < 0) {
+      return fail(err, "Failed to verify the copy of '%s' at '%s'", from, to);
+    }
+    return remove_entry(from);
+  }
+
+  int remove_entry(const std::string& from) {
+    uv_fs_t req;
+    int err = uv_fs_unlink(uv_default_loop(), &req, from.c_str(), NULL);
+    uv_fs_req_cleanup(&req);
+    if (err < 0) {
+      return fail(err, "Failed to remove '%s'", from, "");
+    }
+    return 0;
+  }
+
+  // Check that the copy `to` has the size of `from`, and that `from` is
+  // unchanged since it was stat'ed as `st`. Returns UV_EBUSY otherwise.
+  static int verify(
+      const std::string& from, const std::string& to, const uv_stat_t& st) {
+    uv_stat_t from_st;
+    uv_stat_t to_st;
+    int err = lstat(to, &to_st);
+    if (err < 0) {
+      return err;
+    }
+    err = lstat(from, &from_st);
+    if (err < 0) {
+      return err;
+    }
+    if (to_st.st_size != st.st_size || from_st.st_size != st.st_size ||
+        from_st.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+        from_st.st_mtim.tv_nsec != st.st_mtim.tv_nsec) {
+      return UV_EBUSY;
+    }
+    return 0;
+  }
+
+  // Read the directory of `node`, creating the copies of its sub-directories
+  // and queueing its files in batches.
+  void read(Node* node) {
+    if (failed()) {
+      return;
+    }
+    std::vector<DirEntry> entries;
+    std::vector<uv_stat_t> stats;
+    DirHandle dir;
+    // The directory is read completely before anything in it is removed, as
+    // some file systems may skip entries of a directory which changes while
+    // it is read.
+    int err = dir.open(node->from);
+    if (err == 0) {
+      err = dir.read(true, false, &entries, &stats);
+    }
+    dir.close();
+    if (err < 0) {
+      fail(err, "Failed to search directory '%s'", node->from, "");
+      return;
+    }
+
+    std::string from_prefix = dir_entry_prefix(node->from);
+    std::string to_prefix = dir_entry_prefix(node->to);
+    std::vector<Job> jobs;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      const DirEntry& e = entries[i];
+      std::string from = from_prefix + e.name;
+      std::string to = to_prefix + e.name;
+      if (e.err < 0) {
+        fail(e.err, "Failed to stat '%s'", from, "");
+        return;
+      }
+      if (e.type == UV_DIRENT_DIR) {
+        err = make_dir(to);
+        if (err < 0) {
+          fail(err, "Failed to make directory '%s'", to, "");
+          return;
+        }
+        push(from, to, stats[i], node);
+        continue;
+      }
+      Job job;
+      job.from = from;
+      job.to = to;
+      job.st = stats[i];
+      jobs.push_back(job);
+      if (jobs.size() == MOVE_BATCH_SIZE) {
+        queue_files(node, &jobs);
+      }
+    }
+    if (!jobs.empty()) {
+      queue_files(node, &jobs);
+    }
+    release(node);
+  }
+
+  void queue_files(Node* node, std::vector<Job>* jobs) {
+    __atomic_add_fetch(&node->pending, 1, __ATOMIC_ACQ_REL);
+    pool_->push(new FilesTask(this, node, jobs));
+  }
+
+  void move_files(Node* node, const std::vector<Job>& jobs) {
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      const Job& job = jobs[i];
+      if (failed()) {
+        return;
+      }
+      int err = mode_dirent_type(job.st.st_mode) == UV_DIRENT_FILE
+                    ? move_file(job)
+                    : move_entry(job.from, job.to, job.st);
+      if (err < 0) {
+        return;
+      }
+    }
+    release(node);
+  }
+
+  // Drop one pending part of `node`, finishing it, and in turn its parents,
+  // once nothing is left to move in it.
+  void release(Node* node) {
+    while (node != NULL &&
+           __atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+      int err = set_metadata(node->to, node->st);
+      if (err < 0) {
+        fail(err, "Failed to copy '%s' to '%s'", node->from, node->to);
+        return;
+      }
+      uv_fs_t req;
+      err = uv_fs_rmdir(uv_default_loop(), &req, node->from.c_str(), NULL);
+      uv_fs_req_cleanup(&req);
+      if (err < 0) {
+        fail(err, "Failed to remove '%s'", node->from, "");
+        return;
+      }
+      if (node->parent == NULL) {
+        err = uv_fs_rename(
+            uv_default_loop(), &req, node->to.c_str(), complete_.c_str(), NULL);
+        uv_fs_req_cleanup(&req);
+        if (err < 0) {
+          fail(err, "Failed to move '%s' to '%s'", node->to, complete_);
+          return;
+        }
+      }
+      node = node->parent;
+    }
+  }
+};
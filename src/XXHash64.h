@@ -0,0 +1,205 @@
+#pragma once
+
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+
+#include "uv.h"
+
+// The 64 bit xxHash (XXH64) of a stream of bytes, computed incrementally.
+// Digests are the same as those of the reference implementation with a seed
+// of 0, as printed by `xxhsum`, e.g. `ef46db3751d8e999` for no input.
+//
+// xxHash is not a cryptographic hash, but it is very fast, so hashing files
+// is limited by reading them, and good enough to tell changed files apart.
+//
+// This never calls into R, so it can be used from worker threads.
+class XXHash64 {
+public:
+  XXHash64() : total_(0), size_(0) {
+    acc_[0] = PRIME1 + PRIME2;
+    acc_[1] = PRIME2;
+    acc_[2] = 0;
+    acc_[3] = 0 - PRIME1;
+  }
+
+  void update(const void* data, size_t len) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + len;
+    total_ += len;
+
+    // Top up a partial stripe left from the last update first.
+    if (size_ + len < 32) {
+      memcpy(buf_ + size_, p, len);
+      size_ += len;
+      return;
+    }
+    if (size_ > 0) {
+      size_t fill = 32 - size_;
+      memcpy(buf_ + size_, p, fill);
+      stripe(buf_);
+      p += fill;
+      size_ = 0;
+    }
+    for (; p + 32 <= end; p += 32) {
+      stripe(p);
+    }
+    size_ = end - p;
+    memcpy(buf_, p, size_);
+  }
+
+  uint64_t digest() const {
+    uint64_t h;
+    if (total_ >= 32) {
+      h = rotl(acc_[0], 1) + rotl(acc_[1], 7) + rotl(acc_[2], 12) +
+          rotl(acc_[3], 18);
+      for (int i = 0; i < 4; ++i) {
+        h ^= round(0, acc_[i]);
+        h = h * PRIME1 + PRIME4;
+      }
+    } else {
+      h = PRIME5;
+    }
+    h += total_;
+
+    const unsigned char* p = buf_;
+    const unsigned char* end = buf_ + size_;
+    for (; p + 8 <= end; p += 8) {
+      h ^= round(0, read64(p));
+      h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end) {
+      h ^= read32(p) * PRIME1;
+      h = rotl(h, 23) * PRIME2 + PRIME3;
+      p += 4;
+    }
+    for (; p < end; ++p) {
+      h ^= *p * PRIME5;
+      h = rotl(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+  }
+
+  // Hash the contents of the file at `path` into `*hash`, reading it in
+  // blocks of the size of `*buf`. Returns 0 or a libuv error code.
+  static int file(const char* path, std::vector<char>* buf, uint64_t* hash) {
+    return ends(path, -1, buf, hash);
+  }
+
+  // Hash only the first and last `n` bytes of the file at `path`, or all of
+  // it if it is no longer than `2 * n` or `n` is negative. This is a cheap
+  // test of whether files of the same size may have the same contents.
+  static int
+  ends(const char* path, int64_t n, std::vector<char>* buf, uint64_t* hash) {
+    uv_fs_t req;
+    int fd = uv_fs_open(uv_default_loop(), &req, path, UV_FS_O_RDONLY, 0, NULL);
+    uv_fs_req_cleanup(&req);
+    if (fd < 0) {
+      return fd;
+    }
+
+    // The whole file is read, unless its ends do not overlap.
+    XXHash64 state;
+    int64_t head = -1;
+    int64_t tail = 0;
+    int err = 0;
+    if (n >= 0) {
+      err = uv_fs_fstat(uv_default_loop(), &req, fd, NULL);
+      int64_t size = req.statbuf.st_size;
+      uv_fs_req_cleanup(&req);
+      if (err == 0 && size > 2 * n) {
+        head = n;
+        tail = size - n;
+      }
+    }
+    if (err == 0) {
+      err = read(fd, 0, head, buf, &state);
+    }
+    if (err == 0 && head >= 0) {
+      err = read(fd, tail, n, buf, &state);
+    }
+
+    uv_fs_close(uv_default_loop(), &req, fd, NULL);
+    uv_fs_req_cleanup(&req);
+    if (err == 0) {
+      *hash = state.digest();
+    }
+    return err;
+  }
+
+private:
+  static const uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+  static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+  static const uint64_t PRIME3 = 0x165667B19E3779F9ull;
+  static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ull;
+  static const uint64_t PRIME5 = 0x27D4EB2F165667C5ull;
+
+  uint64_t acc_[4];
+  uint64_t total_;
+  unsigned char buf_[32];
+  size_t size_;
+
+  static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+  // Little endian loads, which compilers turn into single loads.
+  static uint64_t read64(const unsigned char* p) {
+    return static_cast<uint64_t>(read32(p)) |
+           static_cast<uint64_t>(read32(p + 4)) << 32;
+  }
+
+  static uint64_t read32(const unsigned char* p) {
+    return static_cast<uint64_t>(p[0]) | static_cast<uint64_t>(p[1]) << 8 |
+           static_cast<uint64_t>(p[2]) << 16 |
+           static_cast<uint64_t>(p[3]) << 24;
+  }
+
+  static uint64_t round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    return rotl(acc, 31) * PRIME1;
+  }
+
+  // Hash `len` bytes of `fd` from `offset`, or all bytes to the end of the
+  // file if `len` is negative.
+  static int read(
+      uv_file fd,
+      int64_t offset,
+      int64_t len,
+      std::vector<char>* buf,
+      XXHash64* state) {
+    while (len != 0) {
+      size_t size = buf->size();
+      if (len > 0 && static_cast<uint64_t>(len) < size) {
+        size = len;
+      }
+      uv_fs_t req;
+      uv_buf_t b = uv_buf_init(&(*buf)[0], size);
+      int n = uv_fs_read(uv_default_loop(), &req, fd, &b, 1, offset, NULL);
+      uv_fs_req_cleanup(&req);
+      if (n < 0) {
+        return n;
+      }
+      if (n == 0) {
+        break;
+      }
+      state->update(b.base, n);
+      offset += n;
+      if (len > 0) {
+        len -= n;
+      }
+    }
+    return 0;
+  }
+
+  // Consume 32 bytes, 8 into each of the four accumulators.
+  void stripe(const unsigned char* p) {
+    for (int i = 0; i < 4; ++i) {
+      acc_[i] = round(acc_[i], read64(p + 8 * i));
+    }
+  }
+};
@@ -1,7 +1,12 @@
+#include <algorithm>
 #include <cstring>
 #include <limits>
+#include <map>
+#include <set>
 #include <string>
 #include <sys/stat.h>
+#include <utility>
+#include <vector>
 
 #include "getmode.h"
 #include "uv.h"
@@ -9,8 +14,19 @@
 #undef ERROR
 
 #include "CollectorList.h"
+#include "DirCache.h"
+#include "DirHandle.h"
+#include "FileCopy.h"
+#include "IgnoreRules.h"
+#ifdef __linux__
+#include "IoUring.h"
+#endif
+#include "PathFilter.h"
 #include "R.h"
 #include "Rinternals.h"
+#include "StatTable.h"
+#include "ThreadPool.h"
+#include "XXHash64.h"
 #include "error.h"
 #include "utils.h"
 
@@ -67,93 +83,2584 @@ extern "C" SEXP fs_rmdir_(SEXP path) {
   return R_NilValue;
 }
 
-void dir_map(
-    SEXP fun,
-    const char* path,
-    bool all,
-    int file_type,
-    int recurse,
-    CollectorList* value,
-    bool fail) {
+static bool dir_type_matches(uv_dirent_type_t type, int file_type) {
+  return file_type == -1 || (((1 << (type)) & file_type) > 0);
+}
+
+static SEXP list_elt(SEXP list, const char* name) {
+  SEXP names = Rf_getAttrib(list, R_NamesSymbol);
+  for (R_xlen_t i = 0; i < Rf_xlength(list); ++i) {
+    if (strcmp(CHAR(STRING_ELT(names, i)), name) == 0) {
+      return VECTOR_ELT(list, i);
+    }
+  }
+  return R_NilValue;
+}
+
+// The options of a traversal, from the list created by `dir_options()`.
+struct DirOptions {
+  bool all;
+  int file_type;
+  int recurse;
+  bool fail;
+  int threads;
+  // If false the entries of each directory are visited in the order the file
+  // system returns them, and are read `batch` entries at a time.
+  bool sort;
+  int batch;
+  // Entries whose path does not match are not visited, but are still
+  // recursed into.
+  PathFilter filter;
+  // Entries which are excluded, or ignored by the `ignore_files` found along
+  // the way, are neither visited nor recursed into.
+  IgnoreRules exclude;
+  std::vector<std::string> ignore_files;
+  // Whether every entry is lstat'ed and the result passed to the visitor.
+  bool stat;
+  // Whether directory listings are reused from, and saved to, the DirCache.
+  // Listings with stats are always read.
+  bool cache;
+  // Whether the owners of stat'ed entries are resolved using the names kept
+  // for the session.
+  bool owner_cache;
+
+  DirOptions() : stat(false), cache(false), owner_cache(false) {}
+
+  void parse(SEXP options) {
+    all = Rf_asLogical(list_elt(options, "all")) == TRUE;
+    file_type = Rf_asInteger(list_elt(options, "type"));
+    recurse = Rf_asInteger(list_elt(options, "recurse"));
+    fail = Rf_asLogical(list_elt(options, "fail")) != FALSE;
+    threads = Rf_asInteger(list_elt(options, "threads"));
+    sort = Rf_asLogical(list_elt(options, "sort")) != FALSE;
+    batch = Rf_asInteger(list_elt(options, "batch"));
+    stat = Rf_asLogical(list_elt(options, "stat")) == TRUE;
+    cache = Rf_asLogical(list_elt(options, "cache")) == TRUE;
+    owner_cache = Rf_asLogical(list_elt(options, "owner_cache")) == TRUE;
+    if (recurse < 0) {
+      recurse = std::numeric_limits<int>::max();
+    }
+    if (batch == NA_INTEGER || batch < 1) {
+      batch = 1024;
+    }
+
+    SEXP filter_sxp = list_elt(options, "filter");
+    if (filter_sxp != R_NilValue) {
+      const char* type = CHAR(STRING_ELT(list_elt(filter_sxp, "type"), 0));
+      const char* pattern =
+          CHAR(STRING_ELT(list_elt(filter_sxp, "pattern"), 0));
+      PathFilter::Type filter_type = PathFilter::REGEXP;
+      if (strcmp(type, "glob") == 0) {
+        filter_type = PathFilter::GLOB;
+      } else if (strcmp(type, "fixed") == 0) {
+        filter_type = PathFilter::FIXED;
+      }
+      std::string error;
+      if (!filter.set(
+              filter_type,
+              pattern,
+              Rf_asLogical(list_elt(filter_sxp, "ignore_case")) == TRUE,
+              Rf_asLogical(list_elt(filter_sxp, "invert")) == TRUE,
+              Rf_asLogical(list_elt(filter_sxp, "utf8")) == TRUE,
+              &error)) {
+        Rf_error(
+            "invalid regular expression '%s', reason '%s'",
+            pattern,
+            error.c_str());
+      }
+    }
+
+    SEXP exclude_sxp = list_elt(options, "exclude");
+    for (R_xlen_t i = 0; i < Rf_xlength(exclude_sxp); ++i) {
+      exclude.add(CHAR(STRING_ELT(exclude_sxp, i)));
+    }
+    SEXP ignore_files_sxp = list_elt(options, "ignore_files");
+    for (R_xlen_t i = 0; i < Rf_xlength(ignore_files_sxp); ++i) {
+      ignore_files.push_back(CHAR(STRING_ELT(ignore_files_sxp, i)));
+    }
+  }
+
+  bool prunes() const { return !exclude.empty() || !ignore_files.empty(); }
+
+  // Whether the entry `e` at `path` is visited.
+  bool selects(const DirEntry& e, const std::string& path) const {
+    return dir_type_matches(e.type, file_type) && filter.matches(path.c_str());
+  }
+
+private:
+  DirOptions(const DirOptions&);
+  DirOptions& operator=(const DirOptions&);
+};
+
+static void dir_options_finalize(SEXP ptr) {
+  delete static_cast<DirOptions*>(R_ExternalPtrAddr(ptr));
+  R_ClearExternalPtr(ptr);
+}
+
+// Parse the list created by `dir_options()` into an external pointer to a
+// DirOptions, so the compiled filter is freed even if an R error is signaled.
+static SEXP dir_options(SEXP options_sxp) {
+  DirOptions* options = new DirOptions;
+  SEXP ptr = PROTECT(R_MakeExternalPtr(options, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, dir_options_finalize, TRUE);
+  options->parse(options_sxp);
+  UNPROTECT(1);
+  return ptr;
+}
+
+// The listings of previous traversals, used if the `fs.dir_cache` option is
+// set. Each entry costs around 100 bytes, so the cache is capped at about
+// 100 MB.
+#define DIR_CACHE_MAX_ENTRIES 1000000
+static DirCache dir_cache(DIR_CACHE_MAX_ENTRIES);
+
+// Read all of the entries of `dir`, from the listing cache if it is used.
+// Listings which are stat'ed are always read.
+static int read_entries(
+    DirHandle& dir, const DirOptions& options, std::vector<DirEntry>* entries) {
+  if (options.cache && !options.stat) {
+    return dir_cache.read(dir, options.all, options.sort, entries);
+  }
+  return dir.read(options.all, options.sort, entries);
+}
+
+// Add the rules of the ignore files in `dir` to `rules`. Ignore files which
+// cannot be read are skipped.
+static void
+read_ignore_files(DirHandle& dir, const DirOptions& options, IgnoreRules* rules) {
+  std::string contents;
+  for (size_t i = 0; i < options.ignore_files.size(); ++i) {
+    if (dir.read_file(options.ignore_files[i].c_str(), &contents) == 0) {
+      rules->add_lines(contents);
+    }
+  }
+}
+
+// Remove the entries of the directory at `rel`, relative to the root of the
+// traversal, which are ignored by `rules`.
+static void prune_entries(
+    std::vector<DirEntry>* entries,
+    const IgnoreRules& rules,
+    const std::string& rel) {
+  std::string path;
+  size_t n = 0;
+  for (size_t i = 0; i < entries->size(); ++i) {
+    DirEntry& e = (*entries)[i];
+    path.assign(rel).append(e.name);
+    if (rules.ignored(path, e.name.c_str(), e.type == UV_DIRENT_DIR)) {
+      continue;
+    }
+    if (n != i) {
+      (*entries)[n] = e;
+    }
+    ++n;
+  }
+  entries->resize(n);
+}
+
+// Remove the entries of `dir` which are excluded or ignored and, if
+// `options.stat`, lstat the entries which are selected into `stats`, so
+// entries which are filtered out cost no more than reading the directory.
+// `dir` must still be open, and `prefix` and `rel` are its path and its path
+// relative to the root of the traversal.
+//
+// Entries which are not selected are not stat'ed, even if they are recursed
+// into, and keep a zeroed result.
+static void select_entries(
+    DirHandle& dir,
+    const DirOptions& options,
+    const IgnoreRules& rules,
+    const std::string& prefix,
+    const std::string& rel,
+    std::vector<DirEntry>* entries,
+    std::vector<uv_stat_t>* stats) {
+  if (options.prunes()) {
+    prune_entries(entries, rules, rel);
+  }
+  if (!options.stat) {
+    return;
+  }
+
+  uv_stat_t none;
+  memset(&none, 0, sizeof(none));
+  stats->assign(entries->size(), none);
+  std::string path;
+  for (size_t i = 0; i < entries->size(); ++i) {
+    DirEntry& e = (*entries)[i];
+    path.assign(prefix).append(e.name);
+    if (e.err != 0 || !options.selects(e, path)) {
+      continue;
+    }
+    e.err = dir.stat(e.name.c_str(), &(*stats)[i]);
+    if (e.err == 0) {
+      e.type = mode_dirent_type((*stats)[i].st_mode);
+    }
+  }
+}
+
+// The stat result of the `i`th entry, if it was stat'ed successfully. Every
+// entry which exists has a file type in its mode, so those which were not
+// stat'ed are the ones with a zero mode.
+static const uv_stat_t* entry_stat(
+    const std::vector<DirEntry>& entries,
+    const std::vector<uv_stat_t>& stats,
+    size_t i) {
+  if (i >= stats.size() || entries[i].err != 0 || stats[i].st_mode == 0) {
+    return NULL;
+  }
+  return &stats[i];
+}
+
+// Receives each entry of a traversal which matches the requested file types,
+// in traversal order. `st` is the entry's lstat result if requested and
+// successful, otherwise NULL.
+//
+// DirWalker and the parallel traversal also call `enter_dir()` before reading
+// each directory, with the same `st` as the directory's entry, which is NULL
+// if the directory itself is not visited, or with the stat result passed to
+// `walk()` for the roots. If it returns false the
+// directory is skipped, otherwise `leave_dir()` is called once all of its
+// entries have been visited.
+class DirVisitor {
+public:
+  virtual ~DirVisitor() {}
+  virtual void visit(const std::string& path, const uv_stat_t* st) = 0;
+  virtual bool enter_dir(const std::string&, const uv_stat_t*) { return true; }
+  virtual void leave_dir(const std::string&) {}
+};
+
+// Calls an R function on each entry and collects the results in a list.
+class MapVisitor : public DirVisitor {
+  SEXP fun_;
+  CollectorList* value_;
+
+public:
+  MapVisitor(SEXP fun, CollectorList* value) : fun_(fun), value_(value) {}
+
+  void visit(const std::string& path, const uv_stat_t*) {
+    SEXP call = PROTECT(Rf_lang2(fun_, Rf_mkString(path.c_str())));
+    SEXP res = PROTECT(Rf_eval(call, R_GlobalEnv));
+    value_->push_back(res);
+    UNPROTECT(2);
+  }
+};
+
+// Collects the paths of each entry directly in a character vector.
+class ListVisitor : public DirVisitor {
+  CollectorString* value_;
+
+public:
+  explicit ListVisitor(CollectorString* value) : value_(value) {}
+
+  void visit(const std::string& path, const uv_stat_t*) {
+    value_->push_back(path.c_str());
+  }
+};
+
+// Collects the paths and stat results of each entry in a `file_info()` table.
+class InfoVisitor : public DirVisitor {
+  StatTable* value_;
+
+public:
+  explicit InfoVisitor(StatTable* value) : value_(value) {}
+
+  void visit(const std::string& path, const uv_stat_t* st) {
+    value_->push_back(Rf_mkChar(path.c_str()), st);
+  }
+};
+
+// Sums the apparent sizes and the blocks allocated to the entries below each
+// directory, for `dir_size()`. Directories count their own size too, and
+// symbolic links are not followed, as with `du`.
+//
+// Only the directories being walked are kept, so memory grows with the depth
+// of the tree rather than its size, apart from the files with more than one
+// hard link, which are remembered by device and inode so each is only counted
+// once per root.
+//
+// Each directory at most `depth` levels below a root gets a row, which is
+// added when the directory is entered and filled in when it is left, so
+// parents come before their children. If `one_file_system` is true,
+// directories on a different device than their root are skipped.
+class SizeVisitor : public DirVisitor {
+  struct Frame {
+    // The row of the directory, or -1 if it has none.
+    long row;
+    double size;
+    double blocks;
+  };
+
+  int depth_;
+  bool one_file_system_;
+  uint64_t device_;
+  std::vector<Frame> frames_;
+  std::set<std::pair<uint64_t, uint64_t> > links_;
+
+public:
+  std::vector<std::string> paths;
+  std::vector<double> sizes;
+  std::vector<double> blocks;
+
+  SizeVisitor(int depth, bool one_file_system)
+      : depth_(depth < 0 ? std::numeric_limits<int>::max() : depth),
+        one_file_system_(one_file_system), device_(0) {}
+
+  // Add a row for a root which is not a directory, NA if `st` is NULL.
+  void add_root(const std::string& path, const uv_stat_t* st) {
+    paths.push_back(path);
+    sizes.push_back(st == NULL ? NA_REAL : st->st_size);
+    blocks.push_back(st == NULL ? NA_REAL : st->st_blocks);
+  }
+
+  void visit(const std::string&, const uv_stat_t* st) {
+    // Directories are counted when they are entered.
+    if (st == NULL || (st->st_mode & S_IFMT) == S_IFDIR || frames_.empty()) {
+      return;
+    }
+    if (st->st_nlink > 1 &&
+        !links_.insert(std::make_pair(st->st_dev, st->st_ino)).second) {
+      return;
+    }
+    frames_.back().size += st->st_size;
+    frames_.back().blocks += st->st_blocks;
+  }
+
+  bool enter_dir(const std::string& path, const uv_stat_t* st) {
+    if (frames_.empty()) {
+      device_ = st == NULL ? 0 : st->st_dev;
+      links_.clear();
+    } else if (one_file_system_ && st != NULL && st->st_dev != device_) {
+      return false;
+    }
+
+    Frame frame;
+    frame.row = -1;
+    frame.size = st == NULL ? 0 : st->st_size;
+    frame.blocks = st == NULL ? 0 : st->st_blocks;
+    if (frames_.size() <= static_cast<size_t>(depth_)) {
+      frame.row = paths.size();
+      paths.push_back(path);
+      sizes.push_back(NA_REAL);
+      blocks.push_back(NA_REAL);
+    }
+    frames_.push_back(frame);
+    return true;
+  }
+
+  void leave_dir(const std::string&) {
+    Frame frame = frames_.back();
+    frames_.pop_back();
+    if (frame.row >= 0) {
+      sizes[frame.row] = frame.size;
+      blocks[frame.row] = frame.blocks;
+    }
+    if (!frames_.empty()) {
+      frames_.back().size += frame.size;
+      frames_.back().blocks += frame.blocks;
+    }
+  }
+
+  static void finalize(SEXP ptr) {
+    delete static_cast<SizeVisitor*>(R_ExternalPtrAddr(ptr));
+    R_ClearExternalPtr(ptr);
+  }
+};
+
+// The number of bytes hashed from each end of a candidate duplicate before
+// the whole file is, and the number of files hashed by each task.
+#define DUPLICATE_PROBE_SIZE 4096
+#define DUPLICATE_BATCH_SIZE 16
+
+// A file which may be a duplicate and, once hashed, the result.
+struct DuplicateFile {
+  std::string path;
+  uint64_t size;
+  uint64_t hash;
+  int err;
+};
+
+// Hashes a range of candidate duplicates on a worker thread. Unless `whole`
+// is true only the ends of each file are hashed, otherwise only the files
+// whose ends do not already cover them.
+class DuplicateTask : public ThreadPool::Task {
+  std::vector<DuplicateFile>* files_;
+  size_t begin_;
+  size_t end_;
+  bool whole_;
+
+public:
+  DuplicateTask(
+      std::vector<DuplicateFile>* files, size_t begin, size_t end, bool whole)
+      : files_(files), begin_(begin), end_(end), whole_(whole) {}
+
+  void run(ThreadPool&) {
+    std::vector<char> buf(whole_ ? 1 << 18 : DUPLICATE_PROBE_SIZE);
+    for (size_t i = begin_; i < end_; ++i) {
+      DuplicateFile& f = (*files_)[i];
+      if (!whole_) {
+        f.err = XXHash64::ends(
+            f.path.c_str(), DUPLICATE_PROBE_SIZE, &buf, &f.hash);
+      } else if (f.size > 2 * DUPLICATE_PROBE_SIZE) {
+        f.err = XXHash64::file(f.path.c_str(), &buf, &f.hash);
+      }
+    }
+  }
+};
+
+// Finds the duplicate files of a traversal for `dir_duplicates()`, narrowing
+// the candidates at each step so most files are never read:
+//
+// 1. The regular files are grouped by size as they are visited, and only the
+//    files which share their size with another are kept.
+// 2. The first and last few KB of those are hashed, and only the files which
+//    share their size and hash with another are kept.
+// 3. The remaining files are hashed whole, unless their ends already covered
+//    them, and grouped by size and hash again.
+//
+// Each file is only kept once, by its device and inode, so neither the links
+// of a file with several hard links nor a file reached again through
+// overlapping paths are taken for copies.
+class DuplicateVisitor : public DirVisitor {
+  double min_size_;
+  std::set<std::pair<uint64_t, uint64_t> > links_;
+  std::map<uint64_t, std::vector<std::string> > sizes_;
+
+  // Larger files first, then by hash, so each group is a run of files.
+  static bool before(const DuplicateFile& x, const DuplicateFile& y) {
+    if (x.size != y.size) {
+      return x.size > y.size;
+    }
+    return x.hash < y.hash;
+  }
+
+public:
+  std::vector<DuplicateFile> files;
+
+  explicit DuplicateVisitor(double min_size) : min_size_(min_size) {}
+
+  void visit(const std::string& path, const uv_stat_t* st) {
+    if (st == NULL || (st->st_mode & S_IFMT) != S_IFREG ||
+        st->st_size < min_size_) {
+      return;
+    }
+    if (!links_.insert(std::make_pair(st->st_dev, st->st_ino)).second) {
+      return;
+    }
+    sizes_[st->st_size].push_back(path);
+  }
+
+  // Move the files which share their size with another into `files`.
+  void collect() {
+    std::map<uint64_t, std::vector<std::string> >::iterator it;
+    for (it = sizes_.begin(); it != sizes_.end(); ++it) {
+      if (it->second.size() < 2) {
+        continue;
+      }
+      for (size_t i = 0; i < it->second.size(); ++i) {
+        DuplicateFile f;
+        f.path = it->second[i];
+        f.size = it->first;
+        f.hash = 0;
+        f.err = 0;
+        files.push_back(f);
+      }
+    }
+    sizes_.clear();
+  }
+
+  // Hash `files` with `threads` threads, either whole or only their ends.
+  void hash(bool whole, int threads) {
+    ThreadPool pool(threads);
+    for (size_t i = 0; i < files.size(); i += DUPLICATE_BATCH_SIZE) {
+      pool.push(new DuplicateTask(
+          &files,
+          i,
+          std::min(files.size(), i + DUPLICATE_BATCH_SIZE),
+          whole));
+    }
+    pool.wait();
+  }
+
+  // Drop the files which could not be hashed, or which do not share their
+  // size and hash with another, and sort the rest into groups, in the order
+  // they were visited within each group.
+  void group() {
+    size_t n = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+      if (files[i].err == 0) {
+        files[n++] = files[i];
+      }
+    }
+    files.resize(n);
+    std::stable_sort(files.begin(), files.end(), before);
+
+    n = 0;
+    for (size_t i = 0; i < files.size();) {
+      size_t end = i + 1;
+      while (end < files.size() && !before(files[i], files[end])) {
+        ++end;
+      }
+      if (end - i > 1) {
+        for (; i < end; ++i) {
+          files[n++] = files[i];
+        }
+      }
+      i = end;
+    }
+    files.resize(n);
+  }
+
+  // Whether the `i`th file is in a different group than the one before it.
+  bool starts_group(size_t i) const {
+    return i == 0 || before(files[i - 1], files[i]);
+  }
+
+  static void finalize(SEXP ptr) {
+    delete static_cast<DuplicateVisitor*>(R_ExternalPtrAddr(ptr));
+    R_ClearExternalPtr(ptr);
+  }
+};
+
+// The number of files copied by each task of a tree copy, so copying many
+// small files is not dominated by queueing them.
+#define COPY_BATCH_SIZE 64
+
+// A file to copy and, once copied, the result.
+struct CopyJob {
+  std::string from;
+  std::string to;
+  int err;
+};
+
+// Copies, or hard links, a batch of files on a worker thread.
+class CopyTask : public ThreadPool::Task {
+  std::vector<CopyJob>* jobs_;
+  bool overwrite_;
+  FileCopy::Reflink reflink_;
+  bool hard_link_;
+
+public:
+  CopyTask(
+      std::vector<CopyJob>* jobs,
+      bool overwrite,
+      FileCopy::Reflink reflink,
+      bool hard_link)
+      : jobs_(jobs), overwrite_(overwrite), reflink_(reflink),
+        hard_link_(hard_link) {}
+
+  void run(ThreadPool&) {
+    for (size_t i = 0; i < jobs_->size(); ++i) {
+      CopyJob& job = (*jobs_)[i];
+      const char* from = job.from.c_str();
+      const char* to = job.to.c_str();
+      job.err = hard_link_ ? FileCopy::link(from, to, overwrite_, reflink_)
+                           : FileCopy::copy(from, to, overwrite_, reflink_);
+    }
+  }
+};
+
+// Copies a tree for `dir_copy()` in a single walk. Directories are created as
+// they are entered, with the mode used by `dir_create()`, and symbolic links
+// are recreated as they are visited, both on the main thread, so a directory
+// always exists before anything is copied into it. Files are queued in
+// batches and copied by the thread pool while the walk goes on. If
+// `hard_link` is true the files are hard links to the originals instead,
+// unless they are on another device.
+//
+// As copies may still be running, errors are recorded rather than signaled,
+// and `finish()` returns the first once they are done. Nothing more is copied
+// after an error on the main thread.
+class CopyVisitor : public DirVisitor {
+public:
+  // An error and the arguments of its message.
+  struct Error {
+    int err;
+    const char* format;
+    std::string one;
+    std::string two;
+  };
+
+private:
+  std::string from_;
+  std::string from_prefix_;
+  std::string to_;
+  std::string to_prefix_;
+  bool overwrite_;
+  FileCopy::Reflink reflink_;
+  bool hard_link_;
+  // The device and inode of `to`, once it has been created.
+  uint64_t to_dev_;
+  uint64_t to_ino_;
+  ThreadPool* pool_;
+  // The batches queued so far, in traversal order, and the one being filled.
+  std::vector<std::vector<CopyJob>*> batches_;
+  std::vector<CopyJob>* batch_;
+  Error error_;
+
+public:
+  CopyVisitor(
+      const std::string& from,
+      const std::string& to,
+      bool overwrite,
+      FileCopy::Reflink reflink,
+      bool hard_link,
+      int threads)
+      : from_(from), from_prefix_(dir_entry_prefix(from)), to_(to),
+        to_prefix_(dir_entry_prefix(to)), overwrite_(overwrite),
+        reflink_(reflink), hard_link_(hard_link), to_dev_(0), to_ino_(0),
+        pool_(new ThreadPool(threads)), batch_(NULL) {
+    error_.err = 0;
+    error_.format = NULL;
+  }
+
+  ~CopyVisitor() {
+    // Wait for any running copies before their jobs are freed.
+    delete pool_;
+    for (size_t i = 0; i < batches_.size(); ++i) {
+      delete batches_[i];
+    }
+    delete batch_;
+  }
+
+  void visit(const std::string& path, const uv_stat_t* st) {
+    if (error_.err != 0 || st == NULL) {
+      return;
+    }
+    switch (st->st_mode & S_IFMT) {
+    case S_IFDIR:
+      // Directories are created when they are entered.
+      break;
+    case S_IFLNK:
+      copy_link(path, to_path(path));
+      break;
+    default:
+      if (batch_ == NULL) {
+        batch_ = new std::vector<CopyJob>;
+        batch_->reserve(COPY_BATCH_SIZE);
+      }
+      CopyJob job;
+      job.from = path;
+      job.to = to_path(path);
+      job.err = 0;
+      batch_->push_back(job);
+      if (batch_->size() == COPY_BATCH_SIZE) {
+        queue_batch();
+      }
+    }
+  }
+
+  bool enter_dir(const std::string& path, const uv_stat_t* st) {
+    if (error_.err != 0) {
+      return false;
+    }
+    // A copy inside the original, e.g. `dir_copy("foo", "foo/bak")`, is
+    // skipped rather than copied into itself without end.
+    if (st != NULL && to_ino_ != 0 && st->st_dev == to_dev_ &&
+        st->st_ino == to_ino_) {
+      return false;
+    }
+    std::string to = to_path(path);
+    int err = make_dir(to);
+    if (err < 0) {
+      set_error(err, "Failed to make directory '%s'", to, "");
+      return false;
+    }
+    if (path == from_) {
+      uv_fs_t req;
+      err = uv_fs_stat(uv_default_loop(), &req, to.c_str(), NULL);
+      if (err == 0) {
+        to_dev_ = req.statbuf.st_dev;
+        to_ino_ = req.statbuf.st_ino;
+      }
+      uv_fs_req_cleanup(&req);
+    }
+    return true;
+  }
+
+  // Wait for the queued copies, returning the first error, if any.
+  const Error& finish() {
+    queue_batch();
+    pool_->wait();
+    // Copies were queued before any error on the main thread.
+    for (size_t i = 0; i < batches_.size(); ++i) {
+      std::vector<CopyJob>& jobs = *batches_[i];
+      for (size_t j = 0; j < jobs.size(); ++j) {
+        if (jobs[j].err < 0) {
+          error_.err = jobs[j].err;
+          error_.format = hard_link_ ? "Failed to link '%s' to '%s'"
+                                     : "Failed to copy '%s' to '%s'";
+          error_.one = jobs[j].from;
+          error_.two = jobs[j].to;
+          return error_;
+        }
+      }
+    }
+    return error_;
+  }
+
+  static void finalize(SEXP ptr) {
+    delete static_cast<CopyVisitor*>(R_ExternalPtrAddr(ptr));
+    R_ClearExternalPtr(ptr);
+  }
+
+  // Create the directory `path` like `dir_create()`, which succeeds if it
+  // already exists.
+  static int make_dir(const std::string& path) {
+    uv_fs_t req;
+    int err = uv_fs_mkdir(uv_default_loop(), &req, path.c_str(), 0755, NULL);
+    uv_fs_req_cleanup(&req);
+    if (err == UV_EEXIST) {
+      uv_dirent_type_t type;
+      if (lstat_dirent_type(path.c_str(), &type) == 0 &&
+          (type == UV_DIRENT_DIR || type == UV_DIRENT_LINK)) {
+        return 0;
+      }
+      return err;
+    }
+    if (err < 0) {
+      return err;
+    }
+    err = uv_fs_chmod(uv_default_loop(), &req, path.c_str(), 0755, NULL);
+    uv_fs_req_cleanup(&req);
+    return err;
+  }
+
+  // Read the target of the link at `path`.
+  static int read_link(const std::string& path, std::string* target) {
+    uv_fs_t req;
+    int err = uv_fs_readlink(uv_default_loop(), &req, path.c_str(), NULL);
+    if (err == 0) {
+      target->assign(static_cast<const char*>(req.ptr));
+    }
+    uv_fs_req_cleanup(&req);
+    return err;
+  }
+
+private:
+  CopyVisitor(const CopyVisitor&);
+  CopyVisitor& operator=(const CopyVisitor&);
+
+  std::string to_path(const std::string& path) const {
+    if (path == from_) {
+      return to_;
+    }
+    return to_prefix_ + path.substr(from_prefix_.size());
+  }
+
+  void queue_batch() {
+    if (batch_ == NULL) {
+      return;
+    }
+    batches_.push_back(batch_);
+    pool_->push(new CopyTask(batch_, overwrite_, reflink_, hard_link_));
+    batch_ = NULL;
+  }
+
+  void set_error(
+      int err,
+      const char* format,
+      const std::string& one,
+      const std::string& two) {
+    error_.err = err;
+    error_.format = format;
+    error_.one = one;
+    error_.two = two;
+  }
+
+  // Recreate the link at `from` at `to`, like `link_copy()`.
+  void copy_link(const std::string& from, const std::string& to) {
+    std::string target;
+    int err = read_link(from, &target);
+    if (err < 0) {
+      set_error(err, "Failed to read link '%s'", from, "");
+      return;
+    }
+
+    uv_fs_t req;
+    uv_dirent_type_t type;
+    if (overwrite_ && lstat_dirent_type(to.c_str(), &type) == 0 &&
+        type == UV_DIRENT_LINK) {
+      uv_fs_unlink(uv_default_loop(), &req, to.c_str(), NULL);
+      uv_fs_req_cleanup(&req);
+    }
+
+    int flags = 0;
+#ifdef __WIN32
+    flags = UV_FS_SYMLINK_JUNCTION;
+#endif
+    err = uv_fs_symlink(
+        uv_default_loop(), &req, target.c_str(), to.c_str(), flags, NULL);
+    uv_fs_req_cleanup(&req);
+
+    // As with `link_create()` an existing link to the same target is kept.
+    std::string existing;
+    if (err == UV_EEXIST && read_link(to, &existing) == 0 &&
+        path_tidy_(existing) == path_tidy_(target)) {
+      return;
+    }
+    if (err < 0) {
+      set_error(err, "Failed to link '%s' to '%s'", target, to);
+    }
+  }
+};
+
+// The number of directories a DirWalker keeps open. Deeper directories are
+// closed once read, so very deep trees cannot exhaust the file descriptors.
+#define MAX_OPEN_DIRS 64
+
+// Walks a directory tree on the calling thread, visiting each entry as it is
+// reached. The open directories are owned by the walker, which is owned by an
+// R external pointer, so they are closed even if an R error is signaled.
+//
+// Unsorted directories are streamed, so only one batch of entries per open
+// directory is held in memory.
+class DirWalker {
+  struct Frame {
+    DirHandle dir;
+    std::vector<DirEntry> entries;
+    std::vector<uv_stat_t> stats;
+    IgnoreRules rules;
+
+    Frame(const IgnoreRules* parent, const std::string& rel)
+        : rules(parent, rel) {}
+  };
+
+  DirVisitor* visitor_;
+  const DirOptions& options_;
+  std::vector<Frame*> frames_;
+
+public:
+  DirWalker(DirVisitor* visitor, const DirOptions& options)
+      : visitor_(visitor), options_(options) {}
+
+  ~DirWalker() {
+    for (size_t i = 0; i < frames_.size(); ++i) {
+      delete frames_[i];
+    }
+  }
+
+  // Walk the tree at `path`. `st` is passed to the visitor's `enter_dir()`.
+  void walk(const char* path, const uv_stat_t* st = NULL) {
+    walk_dir(path, "", NULL, NULL, options_.recurse, st);
+  }
+
+  static void finalize(SEXP ptr) {
+    delete static_cast<DirWalker*>(R_ExternalPtrAddr(ptr));
+    R_ClearExternalPtr(ptr);
+  }
+
+private:
+  // Returns true if the traversal of this directory should go on after `err`.
+  bool check(int err, const std::string& path) {
+    if (!options_.fail &&
+        warn_for_code(err, "Failed to search directory '%s'", path.c_str())) {
+      return false;
+    }
+    stop_for_code(err, "Failed to search directory '%s'", path.c_str());
+    return true;
+  }
+
+  // Walk the directory at `path`, which is at `rel` relative to the root of
+  // the traversal. If `parent` is not NULL it is the frame of the parent
+  // directory, and `name` is opened relative to it. `st` is the directory's
+  // stat result, if any.
+  void walk_dir(
+      const std::string& path,
+      const std::string& rel,
+      Frame* parent,
+      const char* name,
+      int recurse,
+      const uv_stat_t* st) {
+    if (!visitor_->enter_dir(path, st)) {
+      return;
+    }
+
+    Frame* frame = new Frame(
+        parent == NULL ? &options_.exclude : &parent->rules, rel);
+    frames_.push_back(frame);
+
+    // Deep directories are read whole, so they can be closed straight away,
+    // as are directories which may be cached.
+    bool deep = frames_.size() > MAX_OPEN_DIRS;
+    bool cached = options_.cache && !options_.stat;
+    bool stream = !options_.sort && !deep && !cached;
+
+    int err =
+        frame->dir.open(path, parent == NULL ? NULL : &parent->dir, name);
+    if (err == 0 && !options_.ignore_files.empty()) {
+      read_ignore_files(frame->dir, options_, &frame->rules);
+    }
+    std::string prefix = dir_entry_prefix(path);
+    if (err == 0 && !stream) {
+      err = read_entries(frame->dir, options_, &frame->entries);
+      if (err == 0) {
+        select_entries(
+            frame->dir,
+            options_,
+            frame->rules,
+            prefix,
+            rel,
+            &frame->entries,
+            &frame->stats);
+      }
+    }
+    if (deep) {
+      frame->dir.close();
+    }
+
+    if (check(err, path)) {
+      if (!stream) {
+        visit_entries(frame, prefix, rel, recurse);
+      } else {
+        for (;;) {
+          frame->entries.clear();
+          frame->stats.clear();
+          int res =
+              frame->dir.next(options_.all, &frame->entries, options_.batch);
+          if (!check(res, path) || res == 0) {
+            break;
+          }
+          select_entries(
+              frame->dir,
+              options_,
+              frame->rules,
+              prefix,
+              rel,
+              &frame->entries,
+              &frame->stats);
+          visit_entries(frame, prefix, rel, recurse);
+        }
+      }
+    }
+
+    frames_.pop_back();
+    delete frame;
+    visitor_->leave_dir(path);
+  }
+
+  void visit_entries(
+      Frame* frame,
+      const std::string& prefix,
+      const std::string& rel,
+      int recurse) {
+    std::string child;
+    for (size_t i = 0; i < frame->entries.size(); ++i) {
+      const DirEntry& e = frame->entries[i];
+      child.assign(prefix).append(e.name);
+
+      if (options_.fail) {
+        stop_for_code(e.err, "Failed to stat '%s'", child.c_str());
+      } else {
+        warn_for_code(e.err, "Failed to stat '%s'", child.c_str());
+      }
+
+      const uv_stat_t* st = entry_stat(frame->entries, frame->stats, i);
+      if (options_.selects(e, child)) {
+        visitor_->visit(child, st);
+      }
+
+      if (recurse > 0 && e.type == UV_DIRENT_DIR) {
+        walk_dir(
+            child, rel + e.name + '/', frame, e.name.c_str(), recurse - 1, st);
+      }
+    }
+  }
+};
+
+// A traversal which can be suspended after any entry and resumed later, so
+// R code can pull the entries of a tree a chunk at a time. It visits entries
+// in the same order as DirWalker, but keeps its position in an explicit stack
+// of directories rather than on the call stack.
+//
+// Unsorted directories are streamed as in DirWalker, so the memory used only
+// depends on the depth of the tree, not on the number of entries in it.
+class DirIterator {
+  struct Frame {
+    DirHandle dir;
+    std::string path;
+    std::string prefix;
+    std::string rel;
+    int recurse;
+    std::vector<DirEntry> entries;
+    std::vector<uv_stat_t> stats;
+    // The next entry to visit.
+    size_t pos;
+    // Whether all of the entries of the directory have been read.
+    bool eof;
+    IgnoreRules rules;
+
+    Frame(
+        const std::string& path_,
+        const std::string& rel_,
+        int recurse_,
+        const IgnoreRules* parent)
+        : path(path_), prefix(dir_entry_prefix(path_)), rel(rel_),
+          recurse(recurse_), pos(0), eof(false), rules(parent, rel_) {}
+  };
+
+  const DirOptions& options_;
+  std::vector<std::string> roots_;
+  size_t next_root_;
+  std::vector<Frame*> frames_;
+  // An error to signal at the start of the next call.
+  int pending_err_;
+  std::string pending_path_;
+
+public:
+  DirIterator(SEXP path_sxp, const DirOptions& options)
+      : options_(options), next_root_(0), pending_err_(0) {
+    for (R_xlen_t i = 0; i < Rf_xlength(path_sxp); ++i) {
+      roots_.push_back(CHAR(STRING_ELT(path_sxp, i)));
+    }
+  }
+
+  ~DirIterator() { clear(); }
+
+  // Visit up to `n` more entries, returning the number visited. Fewer than
+  // `n` are only visited once the traversal is finished, or if an error is
+  // signaled by the next call.
+  //
+  // Errors are deferred until no entries have been visited in the current
+  // call, so no results are lost when one is signaled, and conditions are
+  // signaled after the position has moved past the directory or entry they
+  // are about, so if an error is caught the traversal can go on.
+  R_xlen_t next(DirVisitor* visitor, R_xlen_t n) {
+    if (pending_err_ < 0) {
+      int err = pending_err_;
+      pending_err_ = 0;
+      signal(err, pending_path_);
+    }
+
+    R_xlen_t count = 0;
+    std::string child;
+    while (count < n) {
+      if (frames_.empty()) {
+        if (next_root_ == roots_.size()) {
+          break;
+        }
+        const std::string& root = roots_[next_root_++];
+        int err = push_dir(root, "", NULL, NULL, options_.recurse);
+        if (err < 0 && defer(err, root, count)) {
+          return count;
+        }
+        continue;
+      }
+
+      Frame* frame = frames_.back();
+      if (frame->pos == frame->entries.size()) {
+        if (frame->eof) {
+          frames_.pop_back();
+          delete frame;
+          continue;
+        }
+        int err = read_batch(frame);
+        if (err < 0 && defer(err, frame->path, count)) {
+          return count;
+        }
+        continue;
+      }
+
+      const DirEntry& e = frame->entries[frame->pos];
+      child.assign(frame->prefix).append(e.name);
+
+      if (options_.fail && e.err < 0) {
+        if (count > 0) {
+          return count;
+        }
+        ++frame->pos;
+        stop_for_code(e.err, "Failed to stat '%s'", child.c_str());
+      }
+      size_t i = frame->pos++;
+      warn_for_code(e.err, "Failed to stat '%s'", child.c_str());
+
+      if (options_.selects(e, child)) {
+        visitor->visit(child, entry_stat(frame->entries, frame->stats, i));
+        ++count;
+      }
+
+      if (frame->recurse > 0 && e.type == UV_DIRENT_DIR) {
+        int err = push_dir(
+            child,
+            frame->rel + e.name + '/',
+            frame,
+            e.name.c_str(),
+            frame->recurse - 1);
+        if (err < 0 && defer(err, child, count)) {
+          return count;
+        }
+      }
+    }
+    if (count < n) {
+      clear();
+    }
+    return count;
+  }
+
+  static void finalize(SEXP ptr) {
+    delete static_cast<DirIterator*>(R_ExternalPtrAddr(ptr));
+    R_ClearExternalPtr(ptr);
+  }
+
+private:
+  DirIterator(const DirIterator&);
+  DirIterator& operator=(const DirIterator&);
+
+  void clear() {
+    for (size_t i = 0; i < frames_.size(); ++i) {
+      delete frames_[i];
+    }
+    frames_.clear();
+    next_root_ = roots_.size();
+  }
+
+  void signal(int err, const std::string& path) {
+    if (!options_.fail) {
+      warn_for_code(err, "Failed to search directory '%s'", path.c_str());
+    } else {
+      stop_for_code(err, "Failed to search directory '%s'", path.c_str());
+    }
+  }
+
+  // Signal the error for the directory at `path` now, or return true if it
+  // is deferred to the next call as `count` entries have been visited.
+  bool defer(int err, const std::string& path, R_xlen_t count) {
+    if (options_.fail && count > 0) {
+      pending_err_ = err;
+      pending_path_ = path;
+      return true;
+    }
+    signal(err, path);
+    return false;
+  }
+
+  // Open the directory at `path`, relative to the directory of `parent` if it
+  // is not NULL. Sorted and deep directories are read whole straight away.
+  // Returns the error if the directory cannot be read, in which case it is
+  // skipped.
+  int push_dir(
+      const std::string& path,
+      const std::string& rel,
+      Frame* parent,
+      const char* name,
+      int recurse) {
+    Frame* frame = new Frame(
+        path, rel, recurse, parent == NULL ? &options_.exclude : &parent->rules);
+    frames_.push_back(frame);
+
+    bool deep = frames_.size() > MAX_OPEN_DIRS;
+    int err =
+        frame->dir.open(path, parent == NULL ? NULL : &parent->dir, name);
+    if (err == 0 && !options_.ignore_files.empty()) {
+      read_ignore_files(frame->dir, options_, &frame->rules);
+    }
+    if (err == 0 && (options_.sort || deep)) {
+      err = read_entries(frame->dir, options_, &frame->entries);
+      frame->eof = true;
+      if (err == 0) {
+        select_entries(
+            frame->dir,
+            options_,
+            frame->rules,
+            frame->prefix,
+            rel,
+            &frame->entries,
+            &frame->stats);
+      }
+    }
+    if (deep) {
+      frame->dir.close();
+    }
+
+    if (err < 0) {
+      frames_.pop_back();
+      delete frame;
+    }
+    return err;
+  }
+
+  // Read the next batch of entries of a streamed directory.
+  int read_batch(Frame* frame) {
+    frame->entries.clear();
+    frame->stats.clear();
+    frame->pos = 0;
+    int res = frame->dir.next(options_.all, &frame->entries, options_.batch);
+    if (res <= 0) {
+      frame->eof = true;
+      frame->dir.close();
+    }
+    if (res < 0) {
+      return res;
+    }
+    select_entries(
+        frame->dir,
+        options_,
+        frame->rules,
+        frame->prefix,
+        frame->rel,
+        &frame->entries,
+        &frame->stats);
+    return 0;
+  }
+};
+
+// The parallel traversal reads the whole tree into DirNodes on the thread
+// pool, recording any errors rather than signaling them. The tree is then
+// visited on the main thread in the same depth first order as DirWalker,
+// which is where R functions are called and conditions are signaled.
+struct DirNode {
+  std::string path;
+  // The path relative to the root of the traversal.
+  std::string rel;
+  int recurse;
+  int err;
+  bool done;
+  std::vector<DirEntry> entries;
+  std::vector<uv_stat_t> stats;
+  // The sub-directory of each entry which is recursed into, or NULL.
+  std::vector<DirNode*> children;
+  IgnoreRules rules;
+
+  DirNode(
+      const std::string& path_,
+      const std::string& rel_,
+      int recurse_,
+      const IgnoreRules* parent_rules)
+      : path(path_), rel(rel_), recurse(recurse_), err(0), done(false),
+        rules(parent_rules, rel_) {}
+
+  ~DirNode() {
+    for (size_t i = 0; i < children.size(); ++i) {
+      delete children[i];
+    }
+  }
+};
+
+struct DirTree {
+  std::vector<DirNode*> roots;
+
+  ~DirTree() {
+    for (size_t i = 0; i < roots.size(); ++i) {
+      delete roots[i];
+    }
+  }
+};
+
+static void dir_tree_finalize(SEXP ptr) {
+  delete static_cast<DirTree*>(R_ExternalPtrAddr(ptr));
+  R_ClearExternalPtr(ptr);
+}
+
+// Read a directory and queue its sub-directories. If `pool` is NULL the
+// sub-directories are read on the calling thread instead.
+static void
+read_dir_node(DirNode* node, const DirOptions& options, ThreadPool* pool);
+
+class ReadDirTask : public ThreadPool::Task {
+  DirNode* node_;
+  const DirOptions& options_;
+
+public:
+  ReadDirTask(DirNode* node, const DirOptions& options)
+      : node_(node), options_(options) {}
+
+  void run(ThreadPool& pool) { read_dir_node(node_, options_, &pool); }
+};
+
+static void
+read_dir_node(DirNode* node, const DirOptions& options, ThreadPool* pool) {
+  node->done = true;
+
+  // Each directory is opened by its full path, as keeping the parents open
+  // until all of their sub-directories are read could use too many file
+  // descriptors. Its entries are still stat'ed relative to it.
+  DirHandle dir;
+  node->err = dir.open(node->path);
+  if (node->err == 0 && !options.ignore_files.empty()) {
+    read_ignore_files(dir, options, &node->rules);
+  }
+  if (node->err == 0) {
+    node->err = read_entries(dir, options, &node->entries);
+  }
+  std::string prefix = dir_entry_prefix(node->path);
+  if (node->err == 0) {
+    select_entries(
+        dir,
+        options,
+        node->rules,
+        prefix,
+        node->rel,
+        &node->entries,
+        &node->stats);
+  }
+  dir.close();
+
+  if (node->err < 0) {
+    node->entries.clear();
+    node->stats.clear();
+    // The main thread will stop at this node, so nothing after it is needed.
+    if (options.fail && pool != NULL) {
+      pool->cancel();
+    }
+    return;
+  }
+
+  node->children.resize(node->entries.size(), NULL);
+  for (size_t i = 0; i < node->entries.size(); ++i) {
+    const DirEntry& e = node->entries[i];
+    if (e.err < 0 && options.fail && pool != NULL) {
+      pool->cancel();
+    }
+    if (node->recurse > 0 && e.type == UV_DIRENT_DIR) {
+      node->children[i] = new DirNode(
+          prefix + e.name,
+          node->rel + e.name + '/',
+          node->recurse - 1,
+          &node->rules);
+    }
+  }
+
+  for (size_t i = 0; i < node->children.size(); ++i) {
+    DirNode* child = node->children[i];
+    if (child == NULL) {
+      continue;
+    }
+    if (pool != NULL) {
+      pool->push(new ReadDirTask(child, options));
+    } else {
+      read_dir_node(child, options, NULL);
+    }
+  }
+}
+
+static void dir_map_node(
+    DirVisitor* visitor,
+    DirNode* node,
+    const DirOptions& options,
+    const uv_stat_t* node_st) {
+  if (!visitor->enter_dir(node->path, node_st)) {
+    return;
+  }
+
+  // Nodes are only left unread if the traversal was cancelled by an error,
+  // read them now so the same error is signaled as by DirWalker.
+  if (!node->done) {
+    read_dir_node(node, options, NULL);
+  }
+
+  const char* path = node->path.c_str();
+  if (!options.fail &&
+      warn_for_code(node->err, "Failed to search directory '%s'", path)) {
+    visitor->leave_dir(node->path);
+    return;
+  }
+  stop_for_code(node->err, "Failed to search directory '%s'", path);
+
+  std::string prefix = dir_entry_prefix(node->path);
+  std::string child;
+  for (size_t i = 0; i < node->entries.size(); ++i) {
+    const DirEntry& e = node->entries[i];
+    child.assign(prefix).append(e.name);
+
+    if (options.fail) {
+      stop_for_code(e.err, "Failed to stat '%s'", child.c_str());
+    } else {
+      warn_for_code(e.err, "Failed to stat '%s'", child.c_str());
+    }
 
-  BEGIN_CPP
+    const uv_stat_t* st = entry_stat(node->entries, node->stats, i);
+    if (options.selects(e, child)) {
+      visitor->visit(child, st);
+    }
 
-  if (recurse < 0) {
-    recurse = std::numeric_limits<int>::max();
+    if (node->children[i] != NULL) {
+      dir_map_node(visitor, node->children[i], options, st);
+    }
   }
 
-  uv_fs_t req;
-  uv_fs_scandir(uv_default_loop(), &req, path, 0, NULL);
+  visitor->leave_dir(node->path);
+}
+
+// Visit every entry below each of `path_sxp`, reading directories
+// concurrently if more than one thread is requested.
+static void
+dir_traverse(DirVisitor* visitor, SEXP path_sxp, const DirOptions& options) {
 
-  if (!fail && warn_for_error(req, "Failed to search directory '%s'", path)) {
+  if (options.threads <= 1) {
+    DirWalker* walker = new DirWalker(visitor, options);
+    SEXP walker_sxp = PROTECT(R_MakeExternalPtr(walker, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(walker_sxp, DirWalker::finalize, TRUE);
+
+    for (R_xlen_t i = 0; i < Rf_xlength(path_sxp); ++i) {
+      walker->walk(CHAR(STRING_ELT(path_sxp, i)));
+    }
+
+    DirWalker::finalize(walker_sxp);
+    UNPROTECT(1);
     return;
   }
 
-  stop_for_error(req, "Failed to search directory '%s'", path);
+  // The tree is owned by an external pointer so it is freed even if an R
+  // error is signaled while visiting it.
+  DirTree* tree = new DirTree;
+  SEXP tree_sxp = PROTECT(R_MakeExternalPtr(tree, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(tree_sxp, dir_tree_finalize, TRUE);
 
-  uv_dirent_t e;
-  for (int next_res = uv_fs_scandir_next(&req, &e); next_res != UV_EOF;
-       next_res = uv_fs_scandir_next(&req, &e)) {
-    if (!all && e.name[0] == '.') {
-      continue;
+  // Initialize the default loop before any worker thread uses it.
+  uv_default_loop();
+
+  std::string error;
+  {
+    ThreadPool pool(options.threads);
+    for (R_xlen_t i = 0; i < Rf_xlength(path_sxp); ++i) {
+      DirNode* root = new DirNode(
+          CHAR(STRING_ELT(path_sxp, i)), "", options.recurse, &options.exclude);
+      tree->roots.push_back(root);
+      pool.push(new ReadDirTask(root, options));
     }
+    pool.wait();
+    error = pool.error();
+  }
+  if (!error.empty()) {
+    Rf_error("C++ exception: %s", error.c_str());
+  }
+
+  for (size_t i = 0; i < tree->roots.size(); ++i) {
+    dir_map_node(visitor, tree->roots[i], options, NULL);
+  }
+
+  dir_tree_finalize(tree_sxp);
+  UNPROTECT(1);
+}
+
+// [[export]]
+extern "C" SEXP fs_dir_map_(SEXP path_sxp, SEXP fun_sxp, SEXP options_sxp) {
+  SEXP options_ptr = PROTECT(dir_options(options_sxp));
+  CollectorList out;
+  MapVisitor visitor(fun_sxp, &out);
+  dir_traverse(
+      &visitor,
+      path_sxp,
+      *static_cast<DirOptions*>(R_ExternalPtrAddr(options_ptr)));
+  dir_options_finalize(options_ptr);
+  UNPROTECT(1);
+  return out;
+}
+
+// [[export]]
+extern "C" SEXP fs_dir_ls_(SEXP path_sxp, SEXP options_sxp) {
+  SEXP options_ptr = PROTECT(dir_options(options_sxp));
+  CollectorString out;
+  ListVisitor visitor(&out);
+  dir_traverse(
+      &visitor,
+      path_sxp,
+      *static_cast<DirOptions*>(R_ExternalPtrAddr(options_ptr)));
+  dir_options_finalize(options_ptr);
+  UNPROTECT(1);
+  return out;
+}
+
+// [[export]]
+extern "C" SEXP fs_dir_info_(SEXP path_sxp, SEXP options_sxp) {
+  SEXP options_ptr = PROTECT(dir_options(options_sxp));
+  DirOptions* options = static_cast<DirOptions*>(R_ExternalPtrAddr(options_ptr));
+  options->stat = true;
+
+  StatTable out(1, options->owner_cache);
+  PROTECT(out.data());
+  InfoVisitor visitor(&out);
+  dir_traverse(&visitor, path_sxp, *options);
+  dir_options_finalize(options_ptr);
+  UNPROTECT(2);
+  return out;
+}
+
+// [[export]]
+extern "C" SEXP fs_dir_size_(
+    SEXP path_sxp, SEXP depth_sxp, SEXP one_file_system_sxp, SEXP options_sxp) {
+  SEXP options_ptr = PROTECT(dir_options(options_sxp));
+  DirOptions* options = static_cast<DirOptions*>(R_ExternalPtrAddr(options_ptr));
+  options->stat = true;
+
+  // The sums are only kept for the directories being walked, so the tree is
+  // always walked on this thread rather than read whole by a thread pool.
+  SizeVisitor* visitor = new SizeVisitor(
+      INTEGER(depth_sxp)[0], LOGICAL(one_file_system_sxp)[0] == TRUE);
+  SEXP visitor_sxp =
+      PROTECT(R_MakeExternalPtr(visitor, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(visitor_sxp, SizeVisitor::finalize, TRUE);
+  DirWalker* walker = new DirWalker(visitor, *options);
+  SEXP walker_sxp = PROTECT(R_MakeExternalPtr(walker, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(walker_sxp, DirWalker::finalize, TRUE);
 
-    std::string name;
+  for (R_xlen_t i = 0; i < Rf_xlength(path_sxp); ++i) {
+    const char* p = CHAR(STRING_ELT(path_sxp, i));
+    uv_fs_t req;
+    int err = uv_fs_stat(uv_default_loop(), &req, p, NULL);
+    uv_stat_t st = req.statbuf;
+    uv_fs_req_cleanup(&req);
 
-    // If path is '.', just return the name
-    if (strcmp(path, ".") == 0) {
-      name = e.name;
+    if (err < 0) {
+      if (options->fail) {
+        stop_for_code(err, "Failed to stat '%s'", p);
+      }
+      warn_for_code(err, "Failed to stat '%s'", p);
+      visitor->add_root(p, NULL);
+    } else if ((st.st_mode & S_IFMT) != S_IFDIR) {
+      visitor->add_root(p, &st);
+    } else {
+      walker->walk(p, &st);
     }
-    // If path already ends with '/' just concatenate them.
-    else if (path[strlen(path) - 1] == '/') {
-      name = std::string(path) + e.name;
+  }
+
+  R_xlen_t n = visitor->paths.size();
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 3));
+  SEXP paths = Rf_allocVector(STRSXP, n);
+  SET_VECTOR_ELT(out, 0, paths);
+  SEXP sizes = Rf_allocVector(REALSXP, n);
+  SET_VECTOR_ELT(out, 1, sizes);
+  SEXP blocks = Rf_allocVector(REALSXP, n);
+  SET_VECTOR_ELT(out, 2, blocks);
+  for (R_xlen_t i = 0; i < n; ++i) {
+    SET_STRING_ELT(paths, i, Rf_mkChar(visitor->paths[i].c_str()));
+    REAL(sizes)[i] = visitor->sizes[i];
+    REAL(blocks)[i] = visitor->blocks[i];
+  }
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, 3));
+  SET_STRING_ELT(names, 0, Rf_mkChar("path"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("size"));
+  SET_STRING_ELT(names, 2, Rf_mkChar("blocks"));
+  Rf_setAttrib(out, R_NamesSymbol, names);
+
+  DirWalker::finalize(walker_sxp);
+  SizeVisitor::finalize(visitor_sxp);
+  dir_options_finalize(options_ptr);
+  UNPROTECT(5);
+  return out;
+}
+
+// Warn about, or signal, the errors of the files which could not be hashed.
+static void check_duplicates(const DuplicateVisitor& visitor, bool fail) {
+  for (size_t i = 0; i < visitor.files.size(); ++i) {
+    const DuplicateFile& f = visitor.files[i];
+    if (fail) {
+      stop_for_code(f.err, "Failed to hash '%s'", f.path.c_str());
     } else {
-      name = std::string(path) + '/' + e.name;
+      warn_for_code(f.err, "Failed to hash '%s'", f.path.c_str());
     }
-    uv_dirent_type_t entry_type = get_dirent_type(name.c_str(), e.type, fail);
-    if (file_type == -1 || (((1 << (entry_type)) & file_type) > 0)) {
-      SEXP call = PROTECT(Rf_lang2(fun, Rf_mkString(name.c_str())));
-      SEXP res = PROTECT(Rf_eval(call, R_GlobalEnv));
-      value->push_back(res);
-      UNPROTECT(2);
+  }
+}
+
+// [[export]]
+extern "C" SEXP
+fs_dir_duplicates_(SEXP path_sxp, SEXP min_size_sxp, SEXP options_sxp) {
+  SEXP options_ptr = PROTECT(dir_options(options_sxp));
+  DirOptions* options = static_cast<DirOptions*>(R_ExternalPtrAddr(options_ptr));
+  options->stat = true;
+
+  // The candidates are owned by the visitor, so they are freed even if an R
+  // error is signaled. The thread pools never outlive a call to hash().
+  DuplicateVisitor* visitor = new DuplicateVisitor(REAL(min_size_sxp)[0]);
+  SEXP visitor_sxp =
+      PROTECT(R_MakeExternalPtr(visitor, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(visitor_sxp, DuplicateVisitor::finalize, TRUE);
+  DirWalker* walker = new DirWalker(visitor, *options);
+  SEXP walker_sxp = PROTECT(R_MakeExternalPtr(walker, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(walker_sxp, DirWalker::finalize, TRUE);
+
+  for (R_xlen_t i = 0; i < Rf_xlength(path_sxp); ++i) {
+    const char* p = CHAR(STRING_ELT(path_sxp, i));
+    uv_fs_t req;
+    int err = uv_fs_stat(uv_default_loop(), &req, p, NULL);
+    uv_stat_t st = req.statbuf;
+    uv_fs_req_cleanup(&req);
+
+    if (err < 0) {
+      if (options->fail) {
+        stop_for_code(err, "Failed to stat '%s'", p);
+      }
+      warn_for_code(err, "Failed to stat '%s'", p);
+    } else if ((st.st_mode & S_IFMT) != S_IFDIR) {
+      visitor->visit(p, &st);
+    } else {
+      walker->walk(p, &st);
     }
+  }
 
-    if (recurse > 0 && entry_type == UV_DIRENT_DIR) {
-      dir_map(fun, name.c_str(), all, file_type, recurse - 1, value, fail);
+  visitor->collect();
+  visitor->hash(false, options->threads);
+  check_duplicates(*visitor, options->fail);
+  visitor->group();
+  visitor->hash(true, options->threads);
+  check_duplicates(*visitor, options->fail);
+  visitor->group();
+
+  const std::vector<DuplicateFile>& files = visitor->files;
+  R_xlen_t n = files.size();
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 3));
+  SEXP paths = Rf_allocVector(STRSXP, n);
+  SET_VECTOR_ELT(out, 0, paths);
+  SEXP sizes = Rf_allocVector(REALSXP, n);
+  SET_VECTOR_ELT(out, 1, sizes);
+  SEXP groups = Rf_allocVector(INTSXP, n);
+  SET_VECTOR_ELT(out, 2, groups);
+  int group = 0;
+  for (R_xlen_t i = 0; i < n; ++i) {
+    if (visitor->starts_group(i)) {
+      ++group;
     }
-    if (next_res != UV_EOF) {
+    SET_STRING_ELT(paths, i, Rf_mkChar(files[i].path.c_str()));
+    REAL(sizes)[i] = files[i].size;
+    INTEGER(groups)[i] = group;
+  }
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, 3));
+  SET_STRING_ELT(names, 0, Rf_mkChar("path"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("size"));
+  SET_STRING_ELT(names, 2, Rf_mkChar("group"));
+  Rf_setAttrib(out, R_NamesSymbol, names);
 
-      if (!fail && warn_for_error(req, "Failed to open directory '%s'", path)) {
-        continue;
+  DirWalker::finalize(walker_sxp);
+  DuplicateVisitor::finalize(visitor_sxp);
+  dir_options_finalize(options_ptr);
+  UNPROTECT(5);
+  return out;
+}
+
+// [[export]]
+extern "C" SEXP fs_dir_copy_(
+    SEXP path_sxp,
+    SEXP new_path_sxp,
+    SEXP overwrite_sxp,
+    SEXP reflink_sxp,
+    SEXP hard_link_sxp,
+    SEXP options_sxp) {
+  SEXP options_ptr = PROTECT(dir_options(options_sxp));
+  DirOptions* options = static_cast<DirOptions*>(R_ExternalPtrAddr(options_ptr));
+  options->stat = true;
+
+  // Initialize the default loop before any worker thread uses it.
+  uv_default_loop();
+
+  // The directories are walked on this thread, only the copies are
+  // concurrent.
+  const char* path = CHAR(STRING_ELT(path_sxp, 0));
+  CopyVisitor* visitor = new CopyVisitor(
+      path,
+      CHAR(STRING_ELT(new_path_sxp, 0)),
+      LOGICAL(overwrite_sxp)[0] == TRUE,
+      static_cast<FileCopy::Reflink>(INTEGER(reflink_sxp)[0]),
+      LOGICAL(hard_link_sxp)[0] == TRUE,
+      options->threads);
+  SEXP visitor_sxp =
+      PROTECT(R_MakeExternalPtr(visitor, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(visitor_sxp, CopyVisitor::finalize, TRUE);
+  DirWalker* walker = new DirWalker(visitor, *options);
+  SEXP walker_sxp = PROTECT(R_MakeExternalPtr(walker, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(walker_sxp, DirWalker::finalize, TRUE);
+
+  walker->walk(path);
+
+  // The error is signaled once the copies are finished and freed.
+  const CopyVisitor::Error& error = visitor->finish();
+  int err = error.err;
+  const char* format = error.format;
+  SEXP args = PROTECT(Rf_allocVector(STRSXP, 2));
+  if (err < 0) {
+    SET_STRING_ELT(args, 0, Rf_mkChar(error.one.c_str()));
+    SET_STRING_ELT(args, 1, Rf_mkChar(error.two.c_str()));
+  }
+
+  DirWalker::finalize(walker_sxp);
+  CopyVisitor::finalize(visitor_sxp);
+  dir_options_finalize(options_ptr);
+
+  stop_for_code2(
+      err, format, CHAR(STRING_ELT(args, 0)), CHAR(STRING_ELT(args, 1)));
+  UNPROTECT(4);
+  return R_NilValue;
+}
+
+// The number of entries a delete task reads and removes at a time. Elsewhere
+// than Linux a directory is read completely before anything in it is removed,
+// as some file systems, e.g. HFS+, may skip entries if the directory changes
+// while it is being read.
+#ifdef __linux__
+#define DELETE_BATCH_SIZE 1024
+#else
+#define DELETE_BATCH_SIZE std::numeric_limits<int>::max()
+#endif
+
+// A directory being deleted. `pending` counts its sub-directories which are
+// not removed yet, plus one until its own entries have all been read.
+// The device and inode of a sub-directory are those of the entry read from
+// its parent.
+struct DeleteNode {
+  std::string path;
+  DeleteNode* parent;
+  int pending;
+  uint64_t dev;
+  uint64_t ino;
+};
+
+// Deletes directory trees for `dir_delete()` on the thread pool, in a single
+// walk. Each directory is read by its own task, which removes the other
+// entries relative to the open directory as they are read, and queues a task
+// for each sub-directory, so independent sub-trees are deleted concurrently.
+// Whichever task finishes the last part of a directory then removes it, and
+// so on up the tree.
+//
+// Sub-directories are reopened by their full path, so links are not followed
+// and each must still be the directory read from its parent. Otherwise a
+// directory replaced by a link during the deletion could have the files it
+// links to deleted, as in CVE-2022-21658.
+//
+// On Linux, files can be removed through io_uring. The rings are kept by the
+// deleter and reused, so at most one is made per thread.
+//
+// The first error cancels the remaining tasks, and is returned by `wait()`
+// once the pool is idle, so it can be signaled after this is freed.
+class DirDeleter {
+public:
+  DirDeleter(int threads, bool io_uring)
+      : pool_(threads), io_uring_(io_uring), err_(0), err_format_(NULL) {
+    uv_mutex_init(&mutex_);
+  }
+
+  ~DirDeleter() {
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      delete nodes_[i];
+    }
+#ifdef __linux__
+    for (size_t i = 0; i < rings_.size(); ++i) {
+      delete rings_[i];
+    }
+#endif
+    uv_mutex_destroy(&mutex_);
+  }
+
+  void remove(const std::string& path) { push(path, NULL, 0, 0); }
+
+  // Wait for all deletions to finish, returning the first error, if any.
+  int wait(const char** format, std::string* path) {
+    pool_.wait();
+    *format = err_format_;
+    *path = err_path_;
+    return err_;
+  }
+
+private:
+  class Task : public ThreadPool::Task {
+    DirDeleter* deleter_;
+    DeleteNode* node_;
+
+  public:
+    Task(DirDeleter* deleter, DeleteNode* node)
+        : deleter_(deleter), node_(node) {}
+
+    void run(ThreadPool&) { deleter_->read(node_); }
+  };
+
+  ThreadPool pool_;
+  bool io_uring_;
+  uv_mutex_t mutex_;
+  std::vector<DeleteNode*> nodes_;
+#ifdef __linux__
+  // The rings not in use by a task.
+  std::vector<IoUring*> rings_;
+#endif
+  int err_;
+  const char* err_format_;
+  std::string err_path_;
+
+  DirDeleter(const DirDeleter&);
+  DirDeleter& operator=(const DirDeleter&);
+
+  void push(
+      const std::string& path, DeleteNode* parent, uint64_t dev, uint64_t ino) {
+    DeleteNode* node = new DeleteNode;
+    node->path = path;
+    node->parent = parent;
+    node->pending = 1;
+    node->dev = dev;
+    node->ino = ino;
+    if (parent != NULL) {
+      __atomic_add_fetch(&parent->pending, 1, __ATOMIC_ACQ_REL);
+    }
+    uv_mutex_lock(&mutex_);
+    nodes_.push_back(node);
+    uv_mutex_unlock(&mutex_);
+    pool_.push(new Task(this, node));
+  }
+
+  bool failed() {
+    uv_mutex_lock(&mutex_);
+    bool failed = err_ != 0;
+    uv_mutex_unlock(&mutex_);
+    return failed;
+  }
+
+  void fail(int err, const char* format, const std::string& path) {
+    uv_mutex_lock(&mutex_);
+    if (err_ == 0) {
+      err_ = err;
+      err_format_ = format;
+      err_path_ = path;
+    }
+    uv_mutex_unlock(&mutex_);
+    pool_.cancel();
+  }
+
+  // Remove the entries of `node`, then the directory itself if it has no
+  // sub-directories left.
+  void read(DeleteNode* node) {
+    if (failed()) {
+      return;
+    }
+    DirHandle dir;
+    bool root = node->parent == NULL;
+    int err = dir.open(node->path, NULL, NULL, root);
+#ifndef __WIN32
+    if (err == 0 && !root) {
+      uv_stat_t st;
+      memset(&st, 0, sizeof(st));
+      err = dir.stat_self(&st);
+      if (err == 0 && (st.st_dev != node->dev || st.st_ino != node->ino)) {
+        err = UV_ENOENT;
+      }
+    }
+#endif
+    if (err < 0) {
+      fail(err, "Failed to search directory '%s'", node->path);
+      return;
+    }
+    std::string prefix = dir_entry_prefix(node->path);
+    std::vector<DirEntry> entries;
+    std::vector<const char*> files;
+    for (;;) {
+      entries.clear();
+      int n = dir.next(true, &entries, DELETE_BATCH_SIZE);
+      if (n < 0) {
+        fail(n, "Failed to search directory '%s'", node->path);
+        return;
+      }
+      if (n == 0) {
+        break;
+      }
+
+      files.clear();
+      for (size_t i = 0; i < entries.size(); ++i) {
+        const DirEntry& e = entries[i];
+        if (e.err < 0) {
+          fail(e.err, "Failed to stat '%s'", prefix + e.name);
+          return;
+        }
+        if (e.type == UV_DIRENT_DIR) {
+          uv_stat_t st;
+          int res = dir.stat(e.name.c_str(), &st);
+          if (res < 0) {
+            fail(res, "Failed to stat '%s'", prefix + e.name);
+            return;
+          }
+          if (S_ISDIR(st.st_mode)) {
+            push(prefix + e.name, node, st.st_dev, st.st_ino);
+            continue;
+          }
+        }
+        files.push_back(e.name.c_str());
+      }
+      if (!remove_files(dir, prefix, files)) {
+        return;
+      }
+    }
+    dir.close();
+    release(node);
+  }
+
+  // Remove `files`, the names of entries of `dir`, which is at `prefix`.
+  bool remove_files(
+      DirHandle& dir,
+      const std::string& prefix,
+      const std::vector<const char*>& files) {
+    size_t start = 0;
+#ifdef __linux__
+    if (io_uring_ && files.size() > 1) {
+      IoUring& ring = acquire_ring();
+      if (ring.supports(IoUring::UNLINKAT)) {
+        std::vector<IoUring::Request> reqs(files.size());
+        for (size_t i = 0; i < files.size(); ++i) {
+          reqs[i].op = IoUring::UNLINKAT;
+          reqs[i].dirfd = dir.fd();
+          reqs[i].path = files[i];
+          reqs[i].flags = 0;
+        }
+        ring.run(reqs);
+        // Any requests which could not be run are removed as usual.
+        for (; start < files.size() && reqs[start].res != -ECANCELED; ++start) {
+          if (reqs[start].res < 0) {
+            release_ring(&ring);
+            fail(reqs[start].res, "Failed to remove '%s'", prefix + files[start]);
+            return false;
+          }
+        }
+      }
+      release_ring(&ring);
+    }
+#endif
+    for (size_t i = start; i < files.size(); ++i) {
+      int err = dir.remove(files[i], false);
+      if (err < 0) {
+        fail(err, "Failed to remove '%s'", prefix + files[i]);
+        return false;
+      }
+    }
+    return true;
+  }
+
+#ifdef __linux__
+  // Take a ring for the current task, making one if none are free.
+  IoUring& acquire_ring() {
+    IoUring* ring = NULL;
+    uv_mutex_lock(&mutex_);
+    if (!rings_.empty()) {
+      ring = rings_.back();
+      rings_.pop_back();
+    }
+    uv_mutex_unlock(&mutex_);
+    if (ring == NULL) {
+      ring = new IoUring(256);
+    }
+    return *ring;
+  }
+
+  // Return a ring taken by acquire_ring(), so other tasks can reuse it.
+  void release_ring(IoUring* ring) {
+    uv_mutex_lock(&mutex_);
+    rings_.push_back(ring);
+    uv_mutex_unlock(&mutex_);
+  }
+#endif
+
+  // Drop one pending part of `node`, removing it, and in turn its parents,
+  // once nothing is left in it.
+  void release(DeleteNode* node) {
+    while (node != NULL &&
+           __atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+      uv_fs_t req;
+      int err = uv_fs_rmdir(uv_default_loop(), &req, node->path.c_str(), NULL);
+      uv_fs_req_cleanup(&req);
+      if (err < 0) {
+        fail(err, "Failed to remove '%s'", node->path);
+        return;
       }
-      stop_for_error(req, "Failed to open directory '%s'", path);
+      node = node->parent;
     }
   }
-  uv_fs_req_cleanup(&req);
+};
 
-  END_CPP
+// [[export]]
+extern "C" SEXP
+fs_dir_delete_(SEXP path_sxp, SEXP threads_sxp, SEXP io_uring_sxp) {
+  // Initialize the default loop before any worker thread uses it.
+  uv_default_loop();
+
+  int err = 0;
+  const char* format = NULL;
+  SEXP error_path = PROTECT(Rf_allocVector(STRSXP, 1));
+  {
+    DirDeleter deleter(INTEGER(threads_sxp)[0], LOGICAL(io_uring_sxp)[0]);
+    std::string path;
+    for (R_xlen_t i = 0; i < Rf_xlength(path_sxp) && err == 0; ++i) {
+      deleter.remove(CHAR(STRING_ELT(path_sxp, i)));
+      err = deleter.wait(&format, &path);
+    }
+    if (err < 0) {
+      SET_STRING_ELT(error_path, 0, Rf_mkChar(path.c_str()));
+    }
+  }
+
+  // The error is signaled once the deleter is freed.
+  stop_for_code(err, format, CHAR(STRING_ELT(error_path, 0)));
+  UNPROTECT(1);
+  return R_NilValue;
 }
 
+// A file to copy for a sync and, once done, whether it was copied and the
+// result.
+struct SyncJob {
+  std::string from;
+  std::string to;
+  uv_stat_t st;
+  // Whether the contents are compared first, and only copied if they differ.
+  bool compare;
+  // Whether the times of an identical copy differ from the original's.
+  bool touch;
+  // Whether there is an existing file at `to` to replace.
+  bool replace;
+  bool copied;
+  int err;
+};
+
+// Copies a batch of files for a sync on a worker thread. Copies get the
+// times of the originals, so unchanged files are skipped by the next sync.
+class SyncTask : public ThreadPool::Task {
+  std::vector<SyncJob>* jobs_;
+
+public:
+  explicit SyncTask(std::vector<SyncJob>* jobs) : jobs_(jobs) {}
+
+  void run(ThreadPool&) {
+    for (size_t i = 0; i < jobs_->size(); ++i) {
+      SyncJob& job = (*jobs_)[i];
+      const char* from = job.from.c_str();
+      const char* to = job.to.c_str();
+      if (job.compare) {
+        bool same;
+        job.err = FileCopy::compare(from, to, &same);
+        if (job.err == 0 && same) {
+          job.err = job.touch ? FileCopy::set_times(to, job.st) : 0;
+          continue;
+        }
+        if (job.err < 0) {
+          continue;
+        }
+      }
+      // Files are replaced rather than rewritten, which also works for
+      // read-only files.
+      if (job.replace) {
+        uv_fs_t req;
+        uv_fs_unlink(uv_default_loop(), &req, to, NULL);
+        uv_fs_req_cleanup(&req);
+      }
+      job.err = FileCopy::copy(from, to, false, FileCopy::AUTO);
+      if (job.err == 0) {
+        job.err = FileCopy::set_times(to, job.st);
+      }
+      job.copied = job.err == 0;
+    }
+  }
+};
+
+// Synchronizes a tree for `dir_sync()` in a single walk of the source. Each
+// directory of the destination is read as the walk reaches it, and its
+// entries are compared with those of the source. Files which are missing
+// from the destination, or differ in size or modification time, or in
+// contents if `checksum` is true, are queued in batches and copied by the
+// thread pool while the walk goes on, as in CopyVisitor. Directories and
+// links are made on the main thread. If `delete` is true, entries of the
+// destination which are not in the source are deleted once their directory
+// has been walked. Special files, such as FIFOs, are skipped.
+//
+// Each change is recorded as an operation, in traversal order. Errors are
+// handled as in CopyVisitor.
+class SyncVisitor : public DirVisitor {
+public:
+  enum Operation { CREATE, UPDATE, DELETE };
+
+  struct Op {
+    std::string path;
+    // The type of the entry, as in `file_info()`.
+    int type;
+    Operation operation;
+    // For files, the batch and index of the copy, which is only an operation
+    // if the file was copied.
+    std::vector<SyncJob>* batch;
+    size_t job;
+  };
+
+private:
+  // A directory of the source being walked, and the entries of its copy
+  // which have not been seen in the source yet.
+  struct Frame {
+    std::string from_prefix;
+    std::string to;
+    std::string to_prefix;
+    std::map<std::string, uv_stat_t> entries;
+  };
+
+  std::string to_;
+  bool delete_;
+  bool checksum_;
+  int threads_;
+  ThreadPool* pool_;
+  std::vector<std::vector<SyncJob>*> batches_;
+  std::vector<SyncJob>* batch_;
+  std::vector<Frame*> frames_;
+  std::vector<Op> ops_;
+  CopyVisitor::Error error_;
+  // Whether the directory being entered next was just made.
+  bool made_;
+
+public:
+  SyncVisitor(const std::string& to, bool del, bool checksum, int threads)
+      : to_(to), delete_(del), checksum_(checksum), threads_(threads),
+        pool_(new ThreadPool(threads)), batch_(NULL), made_(false) {
+    error_.err = 0;
+    error_.format = NULL;
+  }
+
+  ~SyncVisitor() {
+    // Wait for any running copies before their jobs are freed.
+    delete pool_;
+    for (size_t i = 0; i < batches_.size(); ++i) {
+      delete batches_[i];
+    }
+    delete batch_;
+    for (size_t i = 0; i < frames_.size(); ++i) {
+      delete frames_[i];
+    }
+  }
+
+  void visit(const std::string& path, const uv_stat_t* st) {
+    if (error_.err != 0 || st == NULL) {
+      return;
+    }
+    Frame& frame = *frames_.back();
+    std::string name = path.substr(frame.from_prefix.size());
+    std::string to = frame.to_prefix + name;
+    uv_stat_t to_st;
+    bool exists = false;
+    std::map<std::string, uv_stat_t>::iterator it = frame.entries.find(name);
+    if (it != frame.entries.end()) {
+      to_st = it->second;
+      exists = true;
+      frame.entries.erase(it);
+    }
+    uv_dirent_type_t type = mode_dirent_type(st->st_mode);
+    uv_dirent_type_t to_type =
+        exists ? mode_dirent_type(to_st.st_mode) : UV_DIRENT_UNKNOWN;
+
+    switch (type) {
+    case UV_DIRENT_DIR:
+      made_ = false;
+      if (to_type != UV_DIRENT_DIR) {
+        if (exists && !remove(to, to_st)) {
+          return;
+        }
+        int err = CopyVisitor::make_dir(to);
+        if (err < 0) {
+          set_error(err, "Failed to make directory '%s'", to, "");
+          return;
+        }
+        add_op(to, *st, exists ? UPDATE : CREATE);
+        made_ = true;
+      }
+      break;
+    case UV_DIRENT_LINK:
+      sync_link(path, to, *st, exists ? &to_st : NULL);
+      break;
+    case UV_DIRENT_FILE: {
+      bool compare = false;
+      bool touch = false;
+      if (to_type == UV_DIRENT_FILE && to_st.st_size == st->st_size) {
+        touch = to_st.st_mtim.tv_sec != st->st_mtim.tv_sec;
+        if (checksum_) {
+          compare = true;
+        } else if (!touch) {
+          return;
+        }
+      } else if (exists && to_type != UV_DIRENT_FILE) {
+        if (!remove(to, to_st)) {
+          return;
+        }
+      }
+      queue_file(
+          path,
+          to,
+          *st,
+          compare,
+          touch,
+          to_type == UV_DIRENT_FILE,
+          exists ? UPDATE : CREATE);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  bool enter_dir(const std::string& path, const uv_stat_t*) {
+    if (error_.err != 0) {
+      return false;
+    }
+    std::string to;
+    if (frames_.empty()) {
+      to = to_;
+      uv_fs_t req;
+      int err = uv_fs_lstat(uv_default_loop(), &req, to.c_str(), NULL);
+      uv_stat_t st = req.statbuf;
+      uv_fs_req_cleanup(&req);
+      made_ = false;
+      bool exists = err == 0;
+      if (err == UV_ENOENT || (exists && !S_ISDIR(st.st_mode))) {
+        // An existing link is kept if it is to a directory.
+        err = CopyVisitor::make_dir(to);
+        if (err == 0 && !exists) {
+          st.st_mode = S_IFDIR;
+          add_op(to, st, CREATE);
+          made_ = true;
+        }
+      }
+      if (err < 0) {
+        set_error(err, "Failed to make directory '%s'", to, "");
+        return false;
+      }
+    } else {
+      const Frame& parent = *frames_.back();
+      to = parent.to_prefix + path.substr(parent.from_prefix.size());
+    }
+
+    Frame* frame = new Frame;
+    frame->from_prefix = dir_entry_prefix(path);
+    frame->to = to;
+    frame->to_prefix = dir_entry_prefix(to);
+    frames_.push_back(frame);
+
+    // A directory which was just made has no entries to compare with.
+    if (!made_) {
+      std::vector<DirEntry> entries;
+      std::vector<uv_stat_t> stats;
+      DirHandle dir;
+      int err = dir.open(to);
+      if (err == 0) {
+        err = dir.read(true, false, &entries, &stats);
+      }
+      if (err < 0) {
+        set_error(err, "Failed to search directory '%s'", to, "");
+        return false;
+      }
+      for (size_t i = 0; i < entries.size(); ++i) {
+        if (entries[i].err < 0) {
+          set_error(
+              entries[i].err,
+              "Failed to stat '%s'",
+              frame->to_prefix + entries[i].name,
+              "");
+          return false;
+        }
+        frame->entries[entries[i].name] = stats[i];
+      }
+    }
+    made_ = false;
+    return true;
+  }
+
+  void leave_dir(const std::string&) {
+    Frame* frame = frames_.back();
+    if (delete_ && error_.err == 0) {
+      std::map<std::string, uv_stat_t>::iterator it;
+      for (it = frame->entries.begin(); it != frame->entries.end(); ++it) {
+        std::string to = frame->to_prefix + it->first;
+        if (!remove(to, it->second)) {
+          break;
+        }
+        add_op(to, it->second, DELETE);
+      }
+    }
+    frames_.pop_back();
+    delete frame;
+  }
+
+  // Wait for the queued copies, returning the first error, if any.
+  const CopyVisitor::Error& finish() {
+    queue_batch();
+    pool_->wait();
+    for (size_t i = 0; i < batches_.size(); ++i) {
+      std::vector<SyncJob>& jobs = *batches_[i];
+      for (size_t j = 0; j < jobs.size(); ++j) {
+        if (jobs[j].err < 0) {
+          error_.err = jobs[j].err;
+          error_.format = "Failed to copy '%s' to '%s'";
+          error_.one = jobs[j].from;
+          error_.two = jobs[j].to;
+          return error_;
+        }
+      }
+    }
+    return error_;
+  }
+
+  // The operations, once finished, as a list of `path`, `type` and
+  // `operation` columns.
+  SEXP ops() const {
+    R_xlen_t n = 0;
+    for (size_t i = 0; i < ops_.size(); ++i) {
+      n += is_done(ops_[i]);
+    }
+    SEXP out = PROTECT(Rf_allocVector(VECSXP, 3));
+    SEXP path = Rf_allocVector(STRSXP, n);
+    SET_VECTOR_ELT(out, 0, path);
+    SEXP type = Rf_allocVector(INTSXP, n);
+    SET_VECTOR_ELT(out, 1, type);
+    SEXP operation = Rf_allocVector(INTSXP, n);
+    SET_VECTOR_ELT(out, 2, operation);
+    R_xlen_t j = 0;
+    for (size_t i = 0; i < ops_.size(); ++i) {
+      const Op& op = ops_[i];
+      if (!is_done(op)) {
+        continue;
+      }
+      SET_STRING_ELT(path, j, Rf_mkChar(op.path.c_str()));
+      INTEGER(type)[j] = op.type;
+      INTEGER(operation)[j] = op.operation;
+      ++j;
+    }
+
+    SEXP names = PROTECT(Rf_allocVector(STRSXP, 3));
+    SET_STRING_ELT(names, 0, Rf_mkChar("path"));
+    SET_STRING_ELT(names, 1, Rf_mkChar("type"));
+    SET_STRING_ELT(names, 2, Rf_mkChar("operation"));
+    Rf_setAttrib(out, R_NamesSymbol, names);
+    UNPROTECT(2);
+    return out;
+  }
+
+  static void finalize(SEXP ptr) {
+    delete static_cast<SyncVisitor*>(R_ExternalPtrAddr(ptr));
+    R_ClearExternalPtr(ptr);
+  }
+
+private:
+  SyncVisitor(const SyncVisitor&);
+  SyncVisitor& operator=(const SyncVisitor&);
+
+  static bool is_done(const Op& op) {
+    return op.batch == NULL || (*op.batch)[op.job].copied;
+  }
+
+  void
+  add_op(const std::string& path, const uv_stat_t& st, Operation operation) {
+    Op op;
+    op.path = path;
+    op.type = StatTable::type_code(st.st_mode);
+    op.operation = operation;
+    op.batch = NULL;
+    op.job = 0;
+    ops_.push_back(op);
+  }
+
+  void queue_file(
+      const std::string& from,
+      const std::string& to,
+      const uv_stat_t& st,
+      bool compare,
+      bool touch,
+      bool replace,
+      Operation operation) {
+    if (batch_ == NULL) {
+      batch_ = new std::vector<SyncJob>;
+      batch_->reserve(COPY_BATCH_SIZE);
+    }
+    SyncJob job;
+    job.from = from;
+    job.to = to;
+    job.st = st;
+    job.compare = compare;
+    job.touch = touch;
+    job.replace = replace;
+    job.copied = false;
+    job.err = 0;
+    batch_->push_back(job);
+
+    add_op(to, st, operation);
+    ops_.back().batch = batch_;
+    ops_.back().job = batch_->size() - 1;
+
+    if (batch_->size() == COPY_BATCH_SIZE) {
+      queue_batch();
+    }
+  }
+
+  void queue_batch() {
+    if (batch_ == NULL) {
+      return;
+    }
+    batches_.push_back(batch_);
+    pool_->push(new SyncTask(batch_));
+    batch_ = NULL;
+  }
+
+  // Recreate the link `from` at `to` unless the existing entry, with the
+  // stat result `to_st`, is already a link to the same target.
+  void sync_link(
+      const std::string& from,
+      const std::string& to,
+      const uv_stat_t& st,
+      const uv_stat_t* to_st) {
+    std::string target;
+    int err = CopyVisitor::read_link(from, &target);
+    if (err < 0) {
+      set_error(err, "Failed to read link '%s'", from, "");
+      return;
+    }
+    if (to_st != NULL) {
+      std::string existing;
+      if (S_ISLNK(to_st->st_mode) &&
+          CopyVisitor::read_link(to, &existing) == 0 && existing == target) {
+        return;
+      }
+      if (!remove(to, *to_st)) {
+        return;
+      }
+    }
+
+    int flags = 0;
+#ifdef __WIN32
+    flags = UV_FS_SYMLINK_JUNCTION;
+#endif
+    uv_fs_t req;
+    err = uv_fs_symlink(
+        uv_default_loop(), &req, target.c_str(), to.c_str(), flags, NULL);
+    uv_fs_req_cleanup(&req);
+    if (err < 0) {
+      set_error(err, "Failed to link '%s' to '%s'", target, to);
+      return;
+    }
+    add_op(to, st, to_st != NULL ? UPDATE : CREATE);
+  }
+
+  // Remove the entry of the destination at `path`, with the stat result
+  // `st`, and everything in it if it is a directory.
+  bool remove(const std::string& path, const uv_stat_t& st) {
+    int err;
+    const char* format = "Failed to remove '%s'";
+    std::string error_path = path;
+    if (S_ISDIR(st.st_mode)) {
+      DirDeleter deleter(threads_, false);
+      deleter.remove(path);
+      err = deleter.wait(&format, &error_path);
+    } else {
+      uv_fs_t req;
+      err = uv_fs_unlink(uv_default_loop(), &req, path.c_str(), NULL);
+      uv_fs_req_cleanup(&req);
+    }
+    if (err < 0) {
+      set_error(err, format, error_path, "");
+      return false;
+    }
+    return true;
+  }
+
+  void set_error(
+      int err,
+      const char* format,
+      const std::string& one,
+      const std::string& two) {
+    error_.err = err;
+    error_.format = format;
+    error_.one = one;
+    error_.two = two;
+  }
+};
+
 // [[export]]
-extern "C" SEXP fs_dir_map_(
+extern "C" SEXP fs_dir_sync_(
     SEXP path_sxp,
-    SEXP fun_sxp,
-    SEXP all_sxp,
-    SEXP type_sxp,
-    SEXP recurse_sxp,
-    SEXP fail_sxp) {
+    SEXP new_path_sxp,
+    SEXP delete_sxp,
+    SEXP checksum_sxp,
+    SEXP options_sxp) {
+  SEXP options_ptr = PROTECT(dir_options(options_sxp));
+  DirOptions* options = static_cast<DirOptions*>(R_ExternalPtrAddr(options_ptr));
+  options->stat = true;
 
-  CollectorList out;
-  for (R_xlen_t i = 0; i < Rf_xlength(path_sxp); ++i) {
-    const char* p = CHAR(STRING_ELT(path_sxp, i));
-    dir_map(
-        fun_sxp,
-        p,
-        LOGICAL(all_sxp)[0],
-        INTEGER(type_sxp)[0],
-        INTEGER(recurse_sxp)[0],
-        &out,
-        LOGICAL(fail_sxp)[0]);
+  // Initialize the default loop before any worker thread uses it.
+  uv_default_loop();
+
+  SyncVisitor* visitor = new SyncVisitor(
+      CHAR(STRING_ELT(new_path_sxp, 0)),
+      LOGICAL(delete_sxp)[0] == TRUE,
+      LOGICAL(checksum_sxp)[0] == TRUE,
+      options->threads);
+  SEXP visitor_sxp =
+      PROTECT(R_MakeExternalPtr(visitor, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(visitor_sxp, SyncVisitor::finalize, TRUE);
+  DirWalker* walker = new DirWalker(visitor, *options);
+  SEXP walker_sxp = PROTECT(R_MakeExternalPtr(walker, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(walker_sxp, DirWalker::finalize, TRUE);
+
+  walker->walk(CHAR(STRING_ELT(path_sxp, 0)));
+
+  // The error is signaled once the copies are finished and freed.
+  const CopyVisitor::Error& error = visitor->finish();
+  int err = error.err;
+  const char* format = error.format;
+  SEXP args = PROTECT(Rf_allocVector(STRSXP, 2));
+  if (err < 0) {
+    SET_STRING_ELT(args, 0, Rf_mkChar(error.one.c_str()));
+    SET_STRING_ELT(args, 1, Rf_mkChar(error.two.c_str()));
+  }
+  SEXP out = PROTECT(visitor->ops());
+
+  DirWalker::finalize(walker_sxp);
+  SyncVisitor::finalize(visitor_sxp);
+  dir_options_finalize(options_ptr);
+
+  stop_for_code2(
+      err, format, CHAR(STRING_ELT(args, 0)), CHAR(STRING_ELT(args, 1)));
+  UNPROTECT(5);
+  return out;
+}
+
+// [[export]]
+extern "C" SEXP fs_dir_iterate_(SEXP path_sxp, SEXP options_sxp) {
+  SEXP options_ptr = PROTECT(dir_options(options_sxp));
+  DirOptions* options = static_cast<DirOptions*>(R_ExternalPtrAddr(options_ptr));
+
+  // The iterator's external pointer keeps the options alive.
+  SEXP it_ptr = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, options_ptr));
+  R_RegisterCFinalizerEx(it_ptr, DirIterator::finalize, TRUE);
+  R_SetExternalPtrAddr(it_ptr, new DirIterator(path_sxp, *options));
+  UNPROTECT(2);
+  return it_ptr;
+}
+
+static DirIterator* dir_iterator(SEXP it_ptr) {
+  if (TYPEOF(it_ptr) != EXTPTRSXP || R_ExternalPtrAddr(it_ptr) == NULL) {
+    Rf_error("Invalid directory iterator, it may have been saved and reloaded");
+  }
+  return static_cast<DirIterator*>(R_ExternalPtrAddr(it_ptr));
+}
+
+// [[export]]
+extern "C" SEXP fs_dir_next_(SEXP it_ptr, SEXP n_sxp) {
+  DirIterator* it = dir_iterator(it_ptr);
+  DirOptions* options =
+      static_cast<DirOptions*>(R_ExternalPtrAddr(R_ExternalPtrProtected(it_ptr)));
+  R_xlen_t n = static_cast<R_xlen_t>(REAL(n_sxp)[0]);
+  // The results are grown as needed, so a large `n` is not allocated upfront.
+  R_xlen_t size = n < 1024 ? n : 1024;
+
+  if (options->stat) {
+    StatTable out(size, options->owner_cache);
+    PROTECT(out.data());
+    InfoVisitor visitor(&out);
+    it->next(&visitor, n);
+    UNPROTECT(1);
+    return out;
   }
+
+  CollectorString out(size);
+  ListVisitor visitor(&out);
+  it->next(&visitor, n);
+  return out;
+}
+
+// [[export]]
+extern "C" SEXP fs_dir_cache_clear_() {
+  size_t n = dir_cache.size();
+  dir_cache.clear();
+  return Rf_ScalarReal(n);
+}
+
+// [[export]]
+extern "C" SEXP fs_dir_cache_stats_() {
+  SEXP out = PROTECT(Rf_allocVector(REALSXP, 2));
+  REAL(out)[0] = dir_cache.size();
+  REAL(out)[1] = dir_cache.hits();
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, 2));
+  SET_STRING_ELT(names, 0, Rf_mkChar("size"));
+  SET_STRING_ELT(names, 1, Rf_mkChar("hits"));
+  Rf_setAttrib(out, R_NamesSymbol, names);
+  UNPROTECT(2);
   return out;
 }
@@ -2,16 +2,9 @@
 
 #define BUFSIZE 8192
 
-bool signal_condition(
-    uv_fs_t req, const char* loc, bool error, const char* format, ...) {
+static void vsignal_condition(
+    int err, const char* loc, bool error, const char* format, va_list ap) {
   SEXP condition, c, signalConditionFun, out;
-  va_list ap;
-
-  if (req.result >= 0) {
-    return false;
-  }
-  int err = req.result;
-  uv_fs_req_cleanup(&req);
 
   const char* nms[] = {"message", ""};
   PROTECT(condition = Rf_mkNamed(VECSXP, nms));
@@ -25,9 +18,7 @@ bool signal_condition(
   char buf[BUFSIZE];
   size_t length = 0;
   length += snprintf(buf + length, BUFSIZE - length, "[%s] ", uv_err_name(err));
-  va_start(ap, format);
   length += vsnprintf(buf + length, BUFSIZE - length, format, ap);
-  va_end(ap);
   snprintf(buf + length, BUFSIZE - length, ": %s", uv_strerror(err));
 
   SET_VECTOR_ELT(condition, 0, Rf_mkString(buf));
@@ -43,6 +34,35 @@ bool signal_condition(
   PROTECT(out = Rf_eval(call, R_GlobalEnv));
 
   UNPROTECT(4);
+}
+
+bool signal_condition(
+    uv_fs_t req, const char* loc, bool error, const char* format, ...) {
+  va_list ap;
+
+  if (req.result >= 0) {
+    return false;
+  }
+  int err = req.result;
+  uv_fs_req_cleanup(&req);
+
+  va_start(ap, format);
+  vsignal_condition(err, loc, error, format, ap);
+  va_end(ap);
+
+  return true;
+}
+
+bool signal_code(int err, const char* loc, bool error, const char* format, ...) {
+  va_list ap;
+
+  if (err >= 0) {
+    return false;
+  }
+
+  va_start(ap, format);
+  vsignal_condition(err, loc, error, format, ap);
+  va_end(ap);
 
   return true;
 }
@@ -27,9 +27,22 @@ extern "C" {
 #define warn_for_error(req, format, one)                                       \
   signal_condition(req, __FILE__ ":" STRING(__LINE__), false, format, one)
 
+// Like the above, but for a libuv error code that was recorded earlier, e.g.
+// by a worker thread which cannot call into R itself.
+#define stop_for_code(err, format, one)                                        \
+  signal_code(err, __FILE__ ":" STRING(__LINE__), true, format, one)
+
+#define warn_for_code(err, format, one)                                        \
+  signal_code(err, __FILE__ ":" STRING(__LINE__), false, format, one)
+
+#define stop_for_code2(err, format, one, two)                                  \
+  signal_code(err, __FILE__ ":" STRING(__LINE__), true, format, one, two)
+
 bool signal_condition(
     uv_fs_t req, const char* loc, bool error, const char* format, ...);
 
+bool signal_code(int err, const char* loc, bool error, const char* format, ...);
+
 #ifdef __cplusplus
 }
 #endif
@@ -2,11 +2,21 @@
 #define __STDC_FORMAT_MACROS 1
 #endif
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <inttypes.h>
 
+#include "FileCopy.h"
+#include "StatTable.h"
+#include "ThreadPool.h"
+#include "TreeMove.h"
+#include "XXHash64.h"
+#ifdef __linux__
+#include "IoUring.h"
+#endif
 #include "error.h"
 
 #ifndef __WIN32
@@ -14,6 +24,17 @@
 #include <pwd.h>
 #endif
 
+#ifndef __WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
 #include <R.h>
 #include <Rinternals.h>
 
@@ -23,7 +44,7 @@
 #undef ERROR
 
 // [[export]]
-extern "C" SEXP fs_move_(SEXP path, SEXP new_path) {
+extern "C" SEXP fs_move_(SEXP path, SEXP new_path, SEXP threads_sxp) {
   for (R_xlen_t i = 0; i < Rf_xlength(new_path); ++i) {
     uv_fs_t req;
     const char* p = CHAR(STRING_ELT(path, i));
@@ -31,17 +52,26 @@ extern "C" SEXP fs_move_(SEXP path, SEXP new_path) {
     int res = uv_fs_rename(uv_default_loop(), &req, p, n, NULL);
 
     // Rename does not work across partitions, so we need to instead copy, then
-    // remove the file.
-    if (res == UV_EXDEV) {
-      uv_fs_req_cleanup(&req);
-
-      uv_fs_copyfile(uv_default_loop(), &req, p, n, 0, NULL);
-      stop_for_error2(req, "Failed to copy '%s' to '%s'", p, n);
+    // remove the files. A source which is gone may be an interrupted move of
+    // a directory, which is then resumed.
+    if (res == UV_EXDEV || (res == UV_ENOENT && TreeMove::resumable(n))) {
       uv_fs_req_cleanup(&req);
 
-      uv_fs_unlink(uv_default_loop(), &req, p, NULL);
-      stop_for_error(req, "Failed to remove '%s'", p);
-      uv_fs_req_cleanup(&req);
+      // The error is signaled once the move is freed.
+      const char* format = NULL;
+      SEXP args = PROTECT(Rf_allocVector(STRSXP, 2));
+      {
+        TreeMove move(INTEGER(threads_sxp)[0]);
+        res = move.run(p, n);
+        if (res < 0) {
+          format = move.error().format;
+          SET_STRING_ELT(args, 0, Rf_mkChar(move.error().one.c_str()));
+          SET_STRING_ELT(args, 1, Rf_mkChar(move.error().two.c_str()));
+        }
+      }
+      stop_for_code2(
+          res, format, CHAR(STRING_ELT(args, 0)), CHAR(STRING_ELT(args, 1)));
+      UNPROTECT(1);
       continue;
     }
 
@@ -73,224 +103,492 @@ extern "C" SEXP fs_create_(SEXP path_sxp, SEXP mode_sxp) {
   return R_NilValue;
 }
 
-// [[export]]
-extern "C" SEXP fs_stat_(SEXP path, SEXP fail_sxp) {
-  bool fail = LOGICAL(fail_sxp)[0];
-  // typedef struct {
-  //  uint64_t st_dev;
-  //  uint64_t st_mode;
-  //  uint64_t st_nlink;
-  //  uint64_t st_uid;
-  //  uint64_t st_gid;
-  //  uint64_t st_rdev;
-  //  uint64_t st_ino;
-  //  uint64_t st_size;
-  //  uint64_t st_blksize;
-  //  uint64_t st_blocks;
-  //  uint64_t st_flags;
-  //  uint64_t st_gen;
-  //  uv_timespec_t st_atim;
-  //  uv_timespec_t st_mtim;
-  //  uv_timespec_t st_ctim;
-  //  uv_timespec_t st_birthtim;
+#if defined(__linux__) && defined(STATX_TYPE)
+// The statx() fields needed to fill `columns` of a StatTable.
+static unsigned int statx_mask(StatTable::Columns columns) {
+  static const unsigned int masks[StatTable::N_COLUMNS] = {
+      0,
+      0,
+      STATX_TYPE,
+      STATX_TYPE | STATX_MODE,
+      STATX_NLINK,
+      STATX_UID,
+      STATX_GID,
+      0,
+      STATX_INO,
+      STATX_SIZE,
+      0,
+      STATX_BLOCKS,
+      0,
+      0,
+      STATX_ATIME,
+      STATX_MTIME,
+      STATX_CTIME,
+      STATX_BTIME};
+  unsigned int mask = 0;
+  for (int j = 0; j < StatTable::N_COLUMNS; ++j) {
+    if (columns & (1u << j)) {
+      mask |= masks[j];
+    }
+  }
+  return mask;
+}
 
-  R_xlen_t n = Rf_xlength(path);
+// The same conversion as libuv.
+static void statx_to_uv(const struct statx& stx, uv_stat_t* st) {
+  st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  st->st_mode = stx.stx_mode;
+  st->st_nlink = stx.stx_nlink;
+  st->st_uid = stx.stx_uid;
+  st->st_gid = stx.stx_gid;
+  st->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+  st->st_ino = stx.stx_ino;
+  st->st_size = stx.stx_size;
+  st->st_blksize = stx.stx_blksize;
+  st->st_blocks = stx.stx_blocks;
+  st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+  st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+  st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+  st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+  st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+  st->st_birthtim.tv_sec = stx.stx_btime.tv_sec;
+  st->st_birthtim.tv_nsec = stx.stx_btime.tv_nsec;
+  st->st_flags = 0;
+  st->st_gen = 0;
+}
 
-  SEXP out = PROTECT(Rf_allocVector(VECSXP, 18));
-  SEXP names = PROTECT(Rf_allocVector(STRSXP, 18));
+// Whether a statx() error means it is blocked, e.g. by a seccomp filter, or
+// unsupported by the file system, in which case libuv falls back to lstat().
+static bool statx_unsupported(int err) {
+  return err == EINVAL || err == EPERM || err == ENOSYS || err == EOPNOTSUPP;
+}
+#endif
 
-  SET_STRING_ELT(names, 0, Rf_mkChar("path"));
-  SET_VECTOR_ELT(out, 0, Rf_duplicate(path));
+// lstat `path` into `st`, returning 0 or a libuv error code. On Linux only
+// the fields needed for `columns` are requested from statx(), so network file
+// systems can skip fetching the others. Fields which were not requested may
+// not be set.
+static int
+lstat_columns(const char* path, StatTable::Columns columns, uv_stat_t* st) {
+#if defined(__linux__) && defined(STATX_TYPE)
+  if (columns != StatTable::ALL_COLUMNS) {
+    struct statx stx;
+    memset(&stx, 0, sizeof(stx));
+    int res = statx(
+        AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, statx_mask(columns), &stx);
+    if (res == 0) {
+      statx_to_uv(stx, st);
+      return 0;
+    }
+    if (!statx_unsupported(errno)) {
+      return -errno;
+    }
+  }
+#else
+  (void)columns;
+#endif
+  uv_fs_t req;
+  int res = uv_fs_lstat(uv_default_loop(), &req, path, NULL);
+  if (res == 0) {
+    *st = req.statbuf;
+  }
+  uv_fs_req_cleanup(&req);
+  return res;
+}
 
-  SET_STRING_ELT(names, 1, Rf_mkChar("device_id"));
-  SET_VECTOR_ELT(out, 1, Rf_allocVector(REALSXP, n));
+// The results of lstat'ing a block of paths, as parallel arrays.
+struct StatBlock {
+  std::vector<const char*> paths;
+  std::vector<int> res;
+  std::vector<uv_stat_t> stats;
+  StatTable::Columns columns;
+};
+
+// lstat the paths `[begin, end)` of a block, run on a worker thread.
+class StatTask : public ThreadPool::Task {
+  StatBlock* block_;
+  size_t begin_;
+  size_t end_;
+
+public:
+  StatTask(StatBlock* block, size_t begin, size_t end)
+      : block_(block), begin_(begin), end_(end) {}
+
+  void run(ThreadPool&) {
+    for (size_t i = begin_; i < end_; ++i) {
+      if (block_->paths[i] != NULL) {
+        block_->res[i] = lstat_columns(
+            block_->paths[i], block_->columns, &block_->stats[i]);
+      }
+    }
+  }
+};
+
+#if defined(__linux__) && defined(STATX_TYPE)
+// lstat the paths of a block through `ring`, with all of them in flight at
+// once. Paths the ring could not stat are stat'ed directly.
+static void stat_block_uring(IoUring& ring, StatBlock* block) {
+  size_t size = block->paths.size();
+  unsigned int mask = block->columns == StatTable::ALL_COLUMNS
+                          ? STATX_BASIC_STATS | STATX_BTIME
+                          : statx_mask(block->columns);
+  std::vector<struct statx> stx(size);
+  std::vector<IoUring::Request> reqs;
+  std::vector<size_t> index;
+  for (size_t i = 0; i < size; ++i) {
+    if (block->paths[i] == NULL) {
+      continue;
+    }
+    IoUring::Request req;
+    req.op = IoUring::STATX;
+    req.dirfd = AT_FDCWD;
+    req.path = block->paths[i];
+    req.flags = AT_SYMLINK_NOFOLLOW;
+    req.mask = mask;
+    req.buf = &stx[i];
+    reqs.push_back(req);
+    index.push_back(i);
+  }
 
-  SET_STRING_ELT(names, 2, Rf_mkChar("type"));
-  SET_VECTOR_ELT(out, 2, Rf_allocVector(INTSXP, n));
+  ring.run(reqs);
 
-  SET_STRING_ELT(names, 3, Rf_mkChar("permissions"));
-  SET_VECTOR_ELT(out, 3, Rf_allocVector(INTSXP, n));
-  SEXP class_perm_sxp = PROTECT(Rf_allocVector(STRSXP, 2));
-  SET_STRING_ELT(class_perm_sxp, 0, Rf_mkChar("fs_perms"));
-  SET_STRING_ELT(class_perm_sxp, 1, Rf_mkChar("integer"));
-  Rf_classgets(VECTOR_ELT(out, 3), class_perm_sxp);
-  UNPROTECT(1);
+  for (size_t k = 0; k < reqs.size(); ++k) {
+    size_t i = index[k];
+    if (reqs[k].res == 0) {
+      statx_to_uv(stx[i], &block->stats[i]);
+      block->res[i] = 0;
+    } else if (reqs[k].res == -ECANCELED || statx_unsupported(-reqs[k].res)) {
+      block->res[i] = lstat_columns(
+          block->paths[i], block->columns, &block->stats[i]);
+    } else {
+      block->res[i] = reqs[k].res;
+    }
+  }
+}
+#endif
 
-  SET_STRING_ELT(names, 4, Rf_mkChar("hard_links"));
-  SET_VECTOR_ELT(out, 4, Rf_allocVector(REALSXP, n));
+// The number of paths stat'ed before their rows are added, which bounds the
+// memory used for the intermediate results.
+#define STAT_BLOCK_SIZE 65536
 
-  SET_STRING_ELT(names, 5, Rf_mkChar("user"));
-  SET_VECTOR_ELT(out, 5, Rf_allocVector(STRSXP, n));
+// The number of paths stat'ed by each task of a block.
+#define STAT_TASK_SIZE 256
 
-  SET_STRING_ELT(names, 6, Rf_mkChar("group"));
-  SET_VECTOR_ELT(out, 6, Rf_allocVector(STRSXP, n));
+// [[export]]
+extern "C" SEXP fs_stat_(
+    SEXP path,
+    SEXP fail_sxp,
+    SEXP threads_sxp,
+    SEXP owner_cache_sxp,
+    SEXP fields_sxp,
+    SEXP io_uring_sxp) {
+  bool fail = LOGICAL(fail_sxp)[0];
+  int threads = INTEGER(threads_sxp)[0];
+  bool owner_cache = LOGICAL(owner_cache_sxp)[0];
+  StatTable::Columns columns = StatTable::parse_columns(fields_sxp);
+  bool io_uring = LOGICAL(io_uring_sxp)[0];
 
-  SET_STRING_ELT(names, 7, Rf_mkChar("special_device_id"));
-  SET_VECTOR_ELT(out, 7, Rf_allocVector(REALSXP, n));
+  R_xlen_t n = Rf_xlength(path);
 
-  SET_STRING_ELT(names, 8, Rf_mkChar("inode"));
-  SET_VECTOR_ELT(out, 8, Rf_allocVector(REALSXP, n));
+  // An error, or any warnings, are signaled once the ring, pool and buffers
+  // have been freed, as a handler may jump past their destructors.
+  R_xlen_t error_i = -1;
+  int error_res = 0;
 
-  SET_STRING_ELT(names, 9, Rf_mkChar("size"));
-  SET_VECTOR_ELT(out, 9, Rf_allocVector(REALSXP, n));
+  SEXP out_sxp;
+  SEXP warn_i_sxp;
+  SEXP warn_res_sxp;
+  {
+    StatTable out(n, owner_cache, columns);
+    PROTECT(out.data());
 
-  SEXP class_sxp = PROTECT(Rf_allocVector(STRSXP, 2));
-  SET_STRING_ELT(class_sxp, 0, Rf_mkChar("fs_bytes"));
-  SET_STRING_ELT(class_sxp, 1, Rf_mkChar("numeric"));
-  Rf_classgets(VECTOR_ELT(out, 9), class_sxp);
-  UNPROTECT(1);
+    // Initialize the default loop before any worker thread uses it.
+    uv_default_loop();
 
-  SET_STRING_ELT(names, 10, Rf_mkChar("block_size"));
-  SET_VECTOR_ELT(out, 10, Rf_allocVector(REALSXP, n));
+#if defined(__linux__) && defined(STATX_TYPE)
+    IoUring ring(io_uring ? 256 : 0);
+    bool use_ring = io_uring && ring.supports(IoUring::STATX);
+#else
+    (void)io_uring;
+    bool use_ring = false;
+#endif
 
-  SET_STRING_ELT(names, 11, Rf_mkChar("blocks"));
-  SET_VECTOR_ELT(out, 11, Rf_allocVector(REALSXP, n));
+    StatBlock block;
+    block.columns = columns;
+    std::vector<double> warn_i;
+    std::vector<int> warn_res;
+    for (R_xlen_t start = 0; start < n && error_i < 0;
+         start += STAT_BLOCK_SIZE) {
+      size_t size =
+          std::min(static_cast<R_xlen_t>(STAT_BLOCK_SIZE), n - start);
+
+      // The paths are lstat'ed concurrently, then the rows are added and any
+      // conditions signaled in order on the main thread.
+      block.paths.assign(size, NULL);
+      block.res.assign(size, 0);
+      block.stats.resize(size);
+      for (size_t i = 0; i < size; ++i) {
+        SEXP p = STRING_ELT(path, start + i);
+        if (p != NA_STRING) {
+          block.paths[i] = CHAR(p);
+        }
+      }
+      if (use_ring) {
+#if defined(__linux__) && defined(STATX_TYPE)
+        stat_block_uring(ring, &block);
+        // A ring which failed is not used again.
+        use_ring = ring.ok();
+#endif
+      } else {
+        ThreadPool pool(threads);
+        for (size_t i = 0; i < size; i += STAT_TASK_SIZE) {
+          pool.push(new StatTask(
+              &block, i, std::min(size, i + STAT_TASK_SIZE)));
+        }
+        pool.wait();
+      }
+
+      for (size_t i = 0; i < size; ++i) {
+        SEXP p_sxp = STRING_ELT(path, start + i);
+        int res = block.res[i];
+
+        bool is_na = p_sxp == NA_STRING;
+        bool doesnt_exist = res == UV_ENOENT || res == UV_ENOTDIR;
+        bool has_error = !fail && !doesnt_exist && res < 0;
+        if (has_error) {
+          warn_i.push_back(start + i);
+          warn_res.push_back(res);
+        }
+
+        if (is_na || doesnt_exist || has_error) {
+          out.push_back(p_sxp, NULL);
+          continue;
+        }
+        if (res < 0) {
+          error_i = start + i;
+          error_res = res;
+          break;
+        }
+
+        out.push_back(p_sxp, &block.stats[i]);
+      }
+    }
 
-  SET_STRING_ELT(names, 12, Rf_mkChar("flags"));
-  SET_VECTOR_ELT(out, 12, Rf_allocVector(INTSXP, n));
+    out_sxp = error_i < 0 ? static_cast<SEXP>(out) : R_NilValue;
+    UNPROTECT(1);
+    PROTECT(out_sxp);
+    warn_i_sxp = PROTECT(Rf_allocVector(REALSXP, warn_i.size()));
+    warn_res_sxp = PROTECT(Rf_allocVector(INTSXP, warn_res.size()));
+    for (size_t i = 0; i < warn_i.size(); ++i) {
+      REAL(warn_i_sxp)[i] = warn_i[i];
+      INTEGER(warn_res_sxp)[i] = warn_res[i];
+    }
+  }
 
-  SET_STRING_ELT(names, 13, Rf_mkChar("generation"));
-  SET_VECTOR_ELT(out, 13, Rf_allocVector(REALSXP, n));
+  for (R_xlen_t i = 0; i < Rf_xlength(warn_i_sxp); ++i) {
+    R_xlen_t j = REAL(warn_i_sxp)[i];
+    warn_for_code(
+        INTEGER(warn_res_sxp)[i],
+        "Failed to stat '%s'",
+        CHAR(STRING_ELT(path, j)));
+  }
+  if (error_i >= 0) {
+    stop_for_code(
+        error_res, "Failed to stat '%s'", CHAR(STRING_ELT(path, error_i)));
+  }
+  UNPROTECT(3);
+  return out_sxp;
+}
 
-  SET_STRING_ELT(names, 14, Rf_mkChar("access_time"));
-  SET_VECTOR_ELT(out, 14, Rf_allocVector(REALSXP, n));
+// The mode of `path`, following a final symlink if `follow`, returning 0 or a
+// libuv error code. On Linux only the file type is requested from statx().
+static int stat_type(const char* path, bool follow, uint64_t* mode) {
+#if defined(__linux__) && defined(STATX_TYPE)
+  struct statx stx;
+  int flags = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+  if (statx(AT_FDCWD, path, flags, STATX_TYPE, &stx) == 0) {
+    *mode = stx.stx_mode;
+    return 0;
+  }
+  if (!statx_unsupported(errno)) {
+    return -errno;
+  }
+#endif
+  uv_fs_t req;
+  int res = follow ? uv_fs_stat(uv_default_loop(), &req, path, NULL)
+                   : uv_fs_lstat(uv_default_loop(), &req, path, NULL);
+  if (res == 0) {
+    *mode = req.statbuf.st_mode;
+  }
+  uv_fs_req_cleanup(&req);
+  return res;
+}
 
-  SET_STRING_ELT(names, 15, Rf_mkChar("modification_time"));
-  SET_VECTOR_ELT(out, 15, Rf_allocVector(REALSXP, n));
+// [[export]]
+extern "C" SEXP fs_type_(SEXP path_sxp, SEXP follow_sxp) {
+  bool follow = LOGICAL(follow_sxp)[0];
+  R_xlen_t n = Rf_xlength(path_sxp);
+  SEXP out = PROTECT(Rf_allocVector(INTSXP, n));
+  for (R_xlen_t i = 0; i < n; ++i) {
+    SEXP p_sxp = STRING_ELT(path_sxp, i);
+    INTEGER(out)[i] = NA_INTEGER;
+    if (p_sxp == NA_STRING) {
+      continue;
+    }
+    const char* p = CHAR(p_sxp);
+    uint64_t mode;
+    int res = stat_type(p, follow, &mode);
+    // Paths which do not exist, or links which can not be resolved, have no
+    // type.
+    if (res == UV_ENOENT || res == UV_ENOTDIR || (follow && res == UV_ELOOP)) {
+      continue;
+    }
+    stop_for_code(res, "Failed to stat '%s'", p);
+    INTEGER(out)[i] = StatTable::type_code(mode);
+  }
+  UNPROTECT(1);
+  return out;
+}
 
-  SET_STRING_ELT(names, 16, Rf_mkChar("change_time"));
-  SET_VECTOR_ELT(out, 16, Rf_allocVector(REALSXP, n));
+static int exists_path(const char* path, int) {
+  uv_fs_t req;
+  int res = uv_fs_stat(uv_default_loop(), &req, path, NULL);
+  uv_fs_req_cleanup(&req);
+  return res;
+}
 
-  SET_STRING_ELT(names, 17, Rf_mkChar("birth_time"));
-  SET_VECTOR_ELT(out, 17, Rf_allocVector(REALSXP, n));
+static int access_path(const char* path, int mode) {
+  uv_fs_t req;
+  int res = uv_fs_access(uv_default_loop(), &req, path, mode, NULL);
+  uv_fs_req_cleanup(&req);
+  return res;
+}
 
-  R_xlen_t i;
-  for (i = 0; i < Rf_xlength(path); ++i) {
-    uv_fs_t req;
-    const char* p = CHAR(STRING_ELT(path, i));
-    int res = uv_fs_lstat(uv_default_loop(), &req, p, NULL);
-
-    bool is_na = STRING_ELT(path, i) == NA_STRING;
-    bool doesnt_exist = res == UV_ENOENT || res == UV_ENOTDIR;
-    bool has_error =
-        !fail && !doesnt_exist && warn_for_error(req, "Failed to stat '%s'", p);
-
-    if (is_na || doesnt_exist || has_error) {
-      REAL(VECTOR_ELT(out, 1))[i] = NA_REAL;
-      INTEGER(VECTOR_ELT(out, 2))[i] = NA_INTEGER;
-      INTEGER(VECTOR_ELT(out, 2))[i] = NA_INTEGER;
-      INTEGER(VECTOR_ELT(out, 3))[i] = NA_INTEGER;
-      REAL(VECTOR_ELT(out, 4))[i] = NA_REAL;
-      SET_STRING_ELT(VECTOR_ELT(out, 5), i, NA_STRING);
-      SET_STRING_ELT(VECTOR_ELT(out, 6), i, NA_STRING);
-      REAL(VECTOR_ELT(out, 7))[i] = NA_REAL;
-      REAL(VECTOR_ELT(out, 8))[i] = NA_REAL;
-      REAL(VECTOR_ELT(out, 9))[i] = NA_REAL;
-      REAL(VECTOR_ELT(out, 10))[i] = NA_REAL;
-      REAL(VECTOR_ELT(out, 11))[i] = NA_REAL;
-      INTEGER(VECTOR_ELT(out, 12))[i] = NA_INTEGER;
-      REAL(VECTOR_ELT(out, 13))[i] = NA_REAL;
-      REAL(VECTOR_ELT(out, 14))[i] = NA_REAL;
-      REAL(VECTOR_ELT(out, 15))[i] = NA_REAL;
-      REAL(VECTOR_ELT(out, 16))[i] = NA_REAL;
-      REAL(VECTOR_ELT(out, 17))[i] = NA_REAL;
-      continue;
-    }
-    stop_for_error(req, "Failed to stat '%s'", p);
-
-    uv_stat_t st = req.statbuf;
-    REAL(VECTOR_ELT(out, 1))[i] = st.st_dev;
-    int type;
-    switch (st.st_mode & S_IFMT) {
-    case S_IFBLK:
-      type = 0;
-      break;
-    case S_IFCHR:
-      type = 1;
-      break;
-    case S_IFDIR:
-      type = 2;
-      break;
-    case S_IFIFO:
-      type = 3;
-      break;
-    case S_IFLNK:
-      type = 4;
-      break;
-    case S_IFREG:
-      type = 5;
-      break;
 #ifndef __WIN32
-    case S_IFSOCK:
-      type = 6;
-      break;
-#endif
-    default:
-      type = NA_INTEGER;
-      break;
-    }
-    INTEGER(VECTOR_ELT(out, 2))[i] = type;
-    INTEGER(VECTOR_ELT(out, 3))[i] = st.st_mode;
-    REAL(VECTOR_ELT(out, 4))[i] = st.st_nlink;
+static int exists_at(int dir_fd, const char* name, int) {
+  struct stat st;
+  return fstatat(dir_fd, name, &st, 0) == 0 ? 0 : -errno;
+}
 
-#ifdef __WIN32
-    SET_STRING_ELT(VECTOR_ELT(out, 5), i, NA_STRING);
-#else
-    passwd* pwd;
-    if ((pwd = getpwuid(st.st_uid)) != NULL) {
-      SET_STRING_ELT(VECTOR_ELT(out, 5), i, Rf_mkCharCE(pwd->pw_name, CE_UTF8));
-    } else {
-      char buf[20];
-      snprintf(buf, sizeof(buf), "%" PRIu64, st.st_uid);
-      SET_STRING_ELT(VECTOR_ELT(out, 5), i, Rf_mkCharCE(buf, CE_UTF8));
+static int access_at(int dir_fd, const char* name, int mode) {
+  return faccessat(dir_fd, name, mode, 0) == 0 ? 0 : -errno;
+}
+
+// The length of the parent directory of `path`, up to its last '/', or -1 if
+// it has no parent or its last component can not be checked relative to one,
+// e.g. "foo/" or "foo/..".
+static int parent_length(const char* path) {
+  const char* slash = strrchr(path, '/');
+  const char* name = slash == NULL ? path : slash + 1;
+  if (slash == NULL || *name == '\0' || strcmp(name, ".") == 0 ||
+      strcmp(name, "..") == 0) {
+    return -1;
+  }
+  return slash - path;
+}
+
+// Orders paths by their parent directories.
+class ParentLess {
+  const std::vector<const char*>& paths_;
+  const std::vector<int>& lengths_;
+
+public:
+  ParentLess(
+      const std::vector<const char*>& paths, const std::vector<int>& lengths)
+      : paths_(paths), lengths_(lengths) {}
+
+  int compare(size_t x, size_t y) const {
+    if (lengths_[x] != lengths_[y]) {
+      return lengths_[x] < lengths_[y] ? -1 : 1;
     }
+    return lengths_[x] < 0 ? 0 : memcmp(paths_[x], paths_[y], lengths_[x]);
+  }
+
+  bool operator()(size_t x, size_t y) const {
+    int res = compare(x, y);
+    return res < 0 || (res == 0 && x < y);
+  }
+};
 #endif
 
+// Sets `out[i]` to whether `check` succeeds for each of `path_sxp`.
+//
+// On Unix paths are grouped by their parent directory, and each parent with
+// several children is opened once and its children checked relative to it
+// with `check_at`, so the parent is only resolved once. If the parent does not
+// exist, or is not a directory, none of its children are checked.
+static void check_paths(
+    SEXP path_sxp,
+    int mode,
+    int* out,
+    int (*check)(const char*, int),
+    int (*check_at)(int, const char*, int)) {
+  R_xlen_t n = Rf_xlength(path_sxp);
+  std::vector<const char*> paths(n);
+  for (R_xlen_t i = 0; i < n; ++i) {
+    paths[i] = CHAR(STRING_ELT(path_sxp, i));
+  }
+
 #ifdef __WIN32
-    SET_STRING_ELT(VECTOR_ELT(out, 6), i, NA_STRING);
+  (void)check_at;
+  for (R_xlen_t i = 0; i < n; ++i) {
+    out[i] = check(paths[i], mode) == 0;
+  }
 #else
-    group* grp;
-    if ((grp = getgrgid(st.st_gid)) != NULL) {
-      SET_STRING_ELT(VECTOR_ELT(out, 6), i, Rf_mkCharCE(grp->gr_name, CE_UTF8));
-    } else {
-      char buf[20];
-      snprintf(buf, sizeof(buf), "%" PRIu64, st.st_gid);
-      SET_STRING_ELT(VECTOR_ELT(out, 6), i, Rf_mkCharCE(buf, CE_UTF8));
+  std::vector<int> lengths(n);
+  std::vector<size_t> order(n);
+  for (R_xlen_t i = 0; i < n; ++i) {
+    lengths[i] = parent_length(paths[i]);
+    order[i] = i;
+  }
+  ParentLess less(paths, lengths);
+  std::sort(order.begin(), order.end(), less);
+
+  std::string parent;
+  size_t start = 0;
+  while (start < order.size()) {
+    size_t end = start + 1;
+    while (end < order.size() && less.compare(order[start], order[end]) == 0) {
+      ++end;
     }
-#endif
-
-    REAL(VECTOR_ELT(out, 7))[i] = st.st_rdev;
-    REAL(VECTOR_ELT(out, 8))[i] = st.st_ino;
-    REAL(VECTOR_ELT(out, 9))[i] = st.st_size;
-    REAL(VECTOR_ELT(out, 10))[i] = st.st_blksize;
-    REAL(VECTOR_ELT(out, 11))[i] = st.st_blocks;
-    INTEGER(VECTOR_ELT(out, 12))[i] = st.st_flags;
-    REAL(VECTOR_ELT(out, 13))[i] = st.st_gen;
-
-    REAL(VECTOR_ELT(out, 14))
-    [i] = (st.st_atim.tv_sec + 1e-9 * st.st_atim.tv_nsec);
 
-    REAL(VECTOR_ELT(out, 15))
-    [i] = (st.st_mtim.tv_sec + 1e-9 * st.st_mtim.tv_nsec);
+    size_t first = order[start];
+    int dir_fd = -1;
+    int err = 0;
+    if (lengths[first] >= 0 && end - start > 1) {
+      parent.assign(paths[first], lengths[first]);
+      if (parent.empty()) {
+        parent = "/";
+      }
+#ifdef O_PATH
+      int flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+#else
+      int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+#endif
+      dir_fd = open(parent.c_str(), flags);
+      if (dir_fd < 0) {
+        err = errno;
+      }
+    }
 
-    REAL(VECTOR_ELT(out, 16))
-    [i] = (st.st_ctim.tv_sec + 1e-9 * st.st_ctim.tv_nsec);
+    for (size_t k = start; k < end; ++k) {
+      size_t i = order[k];
+      if (dir_fd >= 0) {
+        out[i] = check_at(dir_fd, paths[i] + lengths[i] + 1, mode) == 0;
+      } else if (err == ENOENT || err == ENOTDIR) {
+        out[i] = false;
+      } else {
+        out[i] = check(paths[i], mode) == 0;
+      }
+    }
 
-    REAL(VECTOR_ELT(out, 17))
-    [i] = (st.st_birthtim.tv_sec + 1e-9 * st.st_birthtim.tv_nsec);
-    uv_fs_req_cleanup(&req);
+    if (dir_fd >= 0) {
+      close(dir_fd);
+    }
+    start = end;
   }
-  Rf_setAttrib(out, R_NamesSymbol, names);
-  Rf_setAttrib(out, R_ClassSymbol, Rf_mkString("data.frame"));
-
-  SEXP row_names = PROTECT(Rf_allocVector(INTSXP, 2));
-  INTEGER(row_names)[0] = NA_INTEGER;
-  INTEGER(row_names)[1] = -i;
-  Rf_setAttrib(out, R_RowNamesSymbol, row_names);
-  UNPROTECT(1);
-
-  UNPROTECT(2);
-  return out;
+#endif
 }
 
 // [[export]]
@@ -299,13 +597,11 @@ extern "C" SEXP fs_exists_(SEXP path_sxp, SEXP name_sxp) {
   SEXP out = PROTECT(Rf_allocVector(LGLSXP, Rf_xlength(path_sxp)));
   Rf_setAttrib(out, R_NamesSymbol, Rf_duplicate(name_sxp));
 
-  for (R_xlen_t i = 0; i < Rf_xlength(path_sxp); ++i) {
-    uv_fs_t req;
-    const char* p = CHAR(STRING_ELT(path_sxp, i));
-    int res = uv_fs_stat(uv_default_loop(), &req, p, NULL);
-    LOGICAL(out)[i] = static_cast<int>(res == 0);
-    uv_fs_req_cleanup(&req);
-  }
+#ifdef __WIN32
+  check_paths(path_sxp, 0, LOGICAL(out), exists_path, NULL);
+#else
+  check_paths(path_sxp, 0, LOGICAL(out), exists_path, exists_at);
+#endif
 
   UNPROTECT(1);
   return out;
@@ -319,13 +615,11 @@ extern "C" SEXP fs_access_(SEXP path_sxp, SEXP mode_sxp) {
   SEXP out = PROTECT(Rf_allocVector(LGLSXP, Rf_xlength(path_sxp)));
   Rf_setAttrib(out, R_NamesSymbol, Rf_duplicate(path_sxp));
 
-  for (R_xlen_t i = 0; i < Rf_xlength(path_sxp); ++i) {
-    uv_fs_t req;
-    const char* p = CHAR(STRING_ELT(path_sxp, i));
-    int res = uv_fs_access(uv_default_loop(), &req, p, mode, NULL);
-    LOGICAL(out)[i] = res == 0;
-    uv_fs_req_cleanup(&req);
-  }
+#ifdef __WIN32
+  check_paths(path_sxp, mode, LOGICAL(out), access_path, NULL);
+#else
+  check_paths(path_sxp, mode, LOGICAL(out), access_path, access_at);
+#endif
 
   UNPROTECT(1);
   return out;
@@ -345,38 +639,217 @@ extern "C" SEXP fs_chmod_(SEXP path_sxp, SEXP mode_sxp) {
   return R_NilValue;
 }
 
+#ifdef __linux__
+// The ring used by `fs_unlink_()`, made on first use and then reused until
+// the package is unloaded. It is only used on the main thread.
+static IoUring* unlink_ring = NULL;
+#endif
+
+// Free the ring of `fs_unlink_()`, called by `fs_cleanup_()`.
+void fs_unlink_cleanup() {
+#ifdef __linux__
+  delete unlink_ring;
+  unlink_ring = NULL;
+#endif
+}
+
 // [[export]]
-extern "C" SEXP fs_unlink_(SEXP path) {
-  for (R_xlen_t i = 0; i < Rf_xlength(path); ++i) {
+extern "C" SEXP fs_unlink_(SEXP path, SEXP io_uring_sxp) {
+  R_xlen_t n = Rf_xlength(path);
+  R_xlen_t start = 0;
+
+  // With io_uring the paths are all removed at once, so if any fail the
+  // others are still removed, including any the ring could not run, and the
+  // first failure is signaled.
+  bool use_ring = false;
+  R_xlen_t error_i = -1;
+  int error_res = 0;
+#ifdef __linux__
+  if (LOGICAL(io_uring_sxp)[0] && n > 1) {
+    if (unlink_ring == NULL) {
+      unlink_ring = new IoUring(256);
+    }
+    IoUring& ring = *unlink_ring;
+    use_ring = ring.supports(IoUring::UNLINKAT);
+    if (use_ring) {
+      std::vector<IoUring::Request> reqs(n);
+      for (R_xlen_t i = 0; i < n; ++i) {
+        reqs[i].op = IoUring::UNLINKAT;
+        reqs[i].dirfd = AT_FDCWD;
+        reqs[i].path = CHAR(STRING_ELT(path, i));
+        reqs[i].flags = 0;
+      }
+      ring.run(reqs);
+      for (R_xlen_t i = 0; i < n; ++i) {
+        if (reqs[i].res == -ECANCELED) {
+          // The rest are removed as usual.
+          break;
+        }
+        if (reqs[i].res < 0 && error_i < 0) {
+          error_i = i;
+          error_res = reqs[i].res;
+        }
+        start = i + 1;
+      }
+    }
+  }
+#else
+  (void)io_uring_sxp;
+#endif
+
+  for (R_xlen_t i = start; i < n; ++i) {
     uv_fs_t req;
     const char* p = CHAR(STRING_ELT(path, i));
-    uv_fs_unlink(uv_default_loop(), &req, p, NULL);
-    stop_for_error(req, "Failed to remove '%s'", p);
+    int res = uv_fs_unlink(uv_default_loop(), &req, p, NULL);
     uv_fs_req_cleanup(&req);
+    if (res < 0 && !use_ring) {
+      stop_for_code(res, "Failed to remove '%s'", p);
+    }
+    if (res < 0 && error_i < 0) {
+      error_i = i;
+      error_res = res;
+    }
   }
 
+  if (error_i >= 0) {
+    stop_for_code(
+        error_res, "Failed to remove '%s'", CHAR(STRING_ELT(path, error_i)));
+  }
   return R_NilValue;
 }
 
+// The number of files hashed by each task.
+#define HASH_TASK_SIZE 16
+
+// The results of hashing paths, as parallel arrays.
+struct HashBlock {
+  std::vector<const char*> paths;
+  std::vector<int> res;
+  std::vector<uint64_t> hashes;
+};
+
+// Hash the files `[begin, end)` of a block, run on a worker thread.
+class HashTask : public ThreadPool::Task {
+  HashBlock* block_;
+  size_t begin_;
+  size_t end_;
+
+public:
+  HashTask(HashBlock* block, size_t begin, size_t end)
+      : block_(block), begin_(begin), end_(end) {}
+
+  void run(ThreadPool&) {
+    std::vector<char> buf(1 << 18);
+    for (size_t i = begin_; i < end_; ++i) {
+      if (block_->paths[i] != NULL) {
+        block_->res[i] =
+            XXHash64::file(block_->paths[i], &buf, &block_->hashes[i]);
+      }
+    }
+  }
+};
+
+// [[export]]
+extern "C" SEXP fs_file_hash_(SEXP path, SEXP fail_sxp, SEXP threads_sxp) {
+  bool fail = LOGICAL(fail_sxp)[0];
+  int threads = INTEGER(threads_sxp)[0];
+  R_xlen_t n = Rf_xlength(path);
+
+  // Warnings and an error are signaled once the pool and buffers have been
+  // freed, as a handler may jump past their destructors.
+  R_xlen_t error_i = -1;
+  int error_res = 0;
+
+  SEXP out = PROTECT(Rf_allocVector(STRSXP, n));
+  SEXP warn_i_sxp;
+  SEXP warn_res_sxp;
+  {
+    HashBlock block;
+    block.paths.assign(n, static_cast<const char*>(NULL));
+    block.res.assign(n, 0);
+    block.hashes.assign(n, 0);
+    for (R_xlen_t i = 0; i < n; ++i) {
+      SEXP p = STRING_ELT(path, i);
+      if (p != NA_STRING) {
+        block.paths[i] = CHAR(p);
+      }
+    }
+
+    // Initialize the default loop before any worker thread uses it.
+    uv_default_loop();
+    {
+      ThreadPool pool(threads);
+      for (size_t i = 0; i < block.paths.size(); i += HASH_TASK_SIZE) {
+        pool.push(new HashTask(
+            &block, i, std::min(block.paths.size(), i + HASH_TASK_SIZE)));
+      }
+      pool.wait();
+    }
+
+    std::vector<double> warn_i;
+    std::vector<int> warn_res;
+    for (R_xlen_t i = 0; i < n; ++i) {
+      SEXP p_sxp = STRING_ELT(path, i);
+      int res = block.res[i];
+      bool has_error = !fail && res < 0;
+      if (has_error) {
+        warn_i.push_back(i);
+        warn_res.push_back(res);
+      }
+      if (p_sxp == NA_STRING || has_error) {
+        SET_STRING_ELT(out, i, NA_STRING);
+        continue;
+      }
+      if (res < 0) {
+        error_i = i;
+        error_res = res;
+        break;
+      }
+      char hex[17];
+      snprintf(hex, sizeof(hex), "%016" PRIx64, block.hashes[i]);
+      SET_STRING_ELT(out, i, Rf_mkChar(hex));
+    }
+
+    warn_i_sxp = PROTECT(Rf_allocVector(REALSXP, warn_i.size()));
+    warn_res_sxp = PROTECT(Rf_allocVector(INTSXP, warn_res.size()));
+    for (size_t i = 0; i < warn_i.size(); ++i) {
+      REAL(warn_i_sxp)[i] = warn_i[i];
+      INTEGER(warn_res_sxp)[i] = warn_res[i];
+    }
+  }
+
+  for (R_xlen_t i = 0; i < Rf_xlength(warn_i_sxp); ++i) {
+    R_xlen_t j = REAL(warn_i_sxp)[i];
+    warn_for_code(
+        INTEGER(warn_res_sxp)[i],
+        "Failed to hash '%s'",
+        CHAR(STRING_ELT(path, j)));
+  }
+  if (error_i >= 0) {
+    stop_for_code(
+        error_res, "Failed to hash '%s'", CHAR(STRING_ELT(path, error_i)));
+  }
+  UNPROTECT(3);
+  return out;
+}
+
 // [[export]]
 extern "C" SEXP
-fs_copyfile_(SEXP path_sxp, SEXP new_path_sxp, SEXP overwrite_sxp) {
+fs_copyfile_(
+    SEXP path_sxp, SEXP new_path_sxp, SEXP overwrite_sxp, SEXP reflink_sxp) {
 
   bool overwrite = LOGICAL(overwrite_sxp)[0];
+  FileCopy::Reflink reflink =
+      static_cast<FileCopy::Reflink>(INTEGER(reflink_sxp)[0]);
 
   for (R_xlen_t i = 0; i < Rf_xlength(path_sxp); ++i) {
-    uv_fs_t req;
     const char* p = CHAR(STRING_ELT(path_sxp, i));
     const char* n = CHAR(STRING_ELT(new_path_sxp, i));
-    uv_fs_copyfile(
-        uv_default_loop(),
-        &req,
+    stop_for_code2(
+        FileCopy::copy(p, n, overwrite, reflink),
+        "Failed to copy '%s' to '%s'",
         p,
-        n,
-        !overwrite ? UV_FS_COPYFILE_EXCL : 0,
-        NULL);
-    stop_for_error2(req, "Failed to copy '%s' to '%s'", p, n);
-    uv_fs_req_cleanup(&req);
+        n);
   }
 
   return R_NilValue;
@@ -2,8 +2,11 @@
 #include "Rinternals.h"
 #include "uv.h"
 
+void fs_unlink_cleanup();
+
 //[[export]]
 extern "C" SEXP fs_cleanup_() {
+  fs_unlink_cleanup();
   uv_loop_close(uv_default_loop());
   return R_NilValue;
 }
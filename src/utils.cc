@@ -5,6 +5,37 @@
 #include "utils.h"
 #include "error.h"
 
+uv_dirent_type_t mode_dirent_type(uint64_t mode) {
+  switch (mode & S_IFMT) {
+  case S_IFBLK:
+    return UV_DIRENT_BLOCK;
+  case S_IFCHR:
+    return UV_DIRENT_CHAR;
+  case S_IFDIR:
+    return UV_DIRENT_DIR;
+  case S_IFIFO:
+    return UV_DIRENT_FIFO;
+  case S_IFLNK:
+    return UV_DIRENT_LINK;
+  case S_IFREG:
+    return UV_DIRENT_FILE;
+#ifndef __WIN32
+  case S_IFSOCK:
+    return UV_DIRENT_SOCKET;
+#endif
+  default:
+    return UV_DIRENT_UNKNOWN;
+  }
+}
+
+int lstat_dirent_type(const char* path, uv_dirent_type_t* type) {
+  uv_fs_t req;
+  int res = uv_fs_lstat(uv_default_loop(), &req, path, NULL);
+  *type = res < 0 ? UV_DIRENT_UNKNOWN : mode_dirent_type(req.statbuf.st_mode);
+  uv_fs_req_cleanup(&req);
+  return res;
+}
+
 // If dirent is not unknown, just return it, otherwise stat the file and get
 // the filetype from that.
 uv_dirent_type_t get_dirent_type(
@@ -16,35 +47,7 @@ uv_dirent_type_t get_dirent_type(
       return UV_DIRENT_UNKNOWN;
     }
     stop_for_error(req, "Failed to stat '%s'", path);
-    uv_dirent_type_t type;
-    switch (req.statbuf.st_mode & S_IFMT) {
-    case S_IFBLK:
-      type = UV_DIRENT_BLOCK;
-      break;
-    case S_IFCHR:
-      type = UV_DIRENT_CHAR;
-      break;
-    case S_IFDIR:
-      type = UV_DIRENT_DIR;
-      break;
-    case S_IFIFO:
-      type = UV_DIRENT_FIFO;
-      break;
-    case S_IFLNK:
-      type = UV_DIRENT_LINK;
-      break;
-    case S_IFREG:
-      type = UV_DIRENT_FILE;
-      break;
-#ifndef __WIN32
-    case S_IFSOCK:
-      type = UV_DIRENT_SOCKET;
-      break;
-#endif
-    default:
-      type = UV_DIRENT_UNKNOWN;
-      break;
-    }
+    uv_dirent_type_t type = mode_dirent_type(req.statbuf.st_mode);
     uv_fs_req_cleanup(&req);
     return type;
   }
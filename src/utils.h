@@ -19,4 +19,11 @@ uv_dirent_type_t get_dirent_type(
     const uv_dirent_type_t& entry_type = UV_DIRENT_UNKNOWN,
     bool fail = true);
 
+// Convert the file type bits of a stat mode to a dirent type.
+uv_dirent_type_t mode_dirent_type(uint64_t mode);
+
+// Like get_dirent_type(), but returns the libuv error code instead of
+// signaling it, so it is safe to call from worker threads.
+int lstat_dirent_type(const char* path, uv_dirent_type_t* type);
+
 std::string path_tidy_(const std::string& in);
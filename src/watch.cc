@@ -0,0 +1,504 @@
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "uv.h"
+
+#undef ERROR
+
+#include "DirHandle.h"
+#include "R.h"
+#include "Rinternals.h"
+#include "error.h"
+
+// Watches paths for changes with libuv file system event or poll handles,
+// which run on a dedicated event loop thread. Changes are queued and
+// coalesced by path until they are drained by the main thread, so watching
+// costs nothing while nothing changes.
+//
+// On macOS and Windows a fully recursive watch uses a single recursive
+// handle. Elsewhere, e.g. with inotify on Linux, every directory of the tree
+// is watched individually, and new directories are watched as they appear.
+//
+// Only the main thread calls into R; errors on the loop thread are recorded
+// and signaled as warnings when the events are drained.
+
+// Longer waits for events, such as `timeout = Inf`, have no deadline.
+#define MAX_WAIT_SECONDS 1e9
+
+class DirWatcher {
+public:
+  // The events of a path, a combination of UV_RENAME and UV_CHANGE.
+  struct Event {
+    std::string path;
+    int events;
+  };
+
+  DirWatcher(int recurse, bool all, bool poll, unsigned int interval)
+      : recurse_(recurse), all_(all), poll_(poll), interval_(interval),
+        running_(false) {
+#if defined(__APPLE__) || defined(__WIN32)
+    native_recursive_ = !poll && recurse == std::numeric_limits<int>::max();
+#else
+    native_recursive_ = false;
+#endif
+    uv_loop_init(&loop_);
+    uv_async_init(&loop_, &stop_, on_stop);
+    stop_.data = this;
+    uv_mutex_init(&mutex_);
+    uv_cond_init(&cond_);
+  }
+
+  ~DirWatcher() {
+    stop();
+    uv_cond_destroy(&cond_);
+    uv_mutex_destroy(&mutex_);
+  }
+
+  // Watch `path`, and its sub-directories up to the recursion depth. Must be
+  // called before `start()`.
+  int add(const std::string& path) { return add_tree(path, recurse_); }
+
+  int start() {
+    int err = uv_thread_create(&thread_, run, this);
+    running_ = err == 0;
+    return err;
+  }
+
+  // Close all handles and wait for the loop thread to finish.
+  void stop() {
+    if (running_) {
+      uv_async_send(&stop_);
+      uv_thread_join(&thread_);
+      running_ = false;
+    } else if (uv_loop_alive(&loop_)) {
+      close_all();
+      uv_run(&loop_, UV_RUN_DEFAULT);
+    } else {
+      return;
+    }
+    uv_loop_close(&loop_);
+  }
+
+  bool running() const { return running_; }
+
+  // Move up to `n` of the queued events, oldest first, to `events`, and any
+  // errors to `errors`. If there are none, wait up to `timeout` seconds for
+  // one, checking for user interrupts meanwhile. Timeouts beyond
+  // MAX_WAIT_SECONDS, such as `Inf`, wait until there is an event.
+  void drain(
+      size_t n,
+      double timeout,
+      std::vector<Event>* events,
+      std::vector<Event>* errors) {
+    bool forever = !(timeout <= MAX_WAIT_SECONDS);
+    uint64_t deadline = uv_hrtime();
+    if (!forever && timeout > 0) {
+      deadline += static_cast<uint64_t>(timeout * 1e9);
+    }
+    uv_mutex_lock(&mutex_);
+    while (order_.empty() && errors_.empty() && running_ &&
+           (forever || uv_hrtime() < deadline)) {
+      uint64_t wait = forever ? 100000000 : deadline - uv_hrtime();
+      // Wake up regularly so the user can interrupt the wait.
+      if (wait > 100000000) {
+        wait = 100000000;
+      }
+      uv_cond_timedwait(&cond_, &mutex_, wait);
+      uv_mutex_unlock(&mutex_);
+      R_CheckUserInterrupt();
+      uv_mutex_lock(&mutex_);
+    }
+
+    size_t count = std::min(n, order_.size());
+    for (size_t i = 0; i < count; ++i) {
+      Event e;
+      e.path = order_[i];
+      e.events = queued_[e.path];
+      queued_.erase(e.path);
+      events->push_back(e);
+    }
+    order_.erase(order_.begin(), order_.begin() + count);
+    errors->swap(errors_);
+    errors_.clear();
+    uv_mutex_unlock(&mutex_);
+  }
+
+  static void finalize(SEXP ptr) {
+    delete static_cast<DirWatcher*>(R_ExternalPtrAddr(ptr));
+    R_ClearExternalPtr(ptr);
+  }
+
+private:
+  DirWatcher(const DirWatcher&);
+  DirWatcher& operator=(const DirWatcher&);
+
+  struct Watch {
+    union {
+      uv_handle_t handle;
+      uv_fs_event_t event;
+      uv_fs_poll_t poll;
+    };
+    DirWatcher* watcher;
+    std::string path;
+    bool is_dir;
+    // The number of levels of sub-directories to watch below this one.
+    int recurse;
+    // Whether the last poll of the path failed.
+    bool missing;
+  };
+
+  static void run(void* data) {
+    DirWatcher* self = static_cast<DirWatcher*>(data);
+    uv_run(&self->loop_, UV_RUN_DEFAULT);
+  }
+
+  // Called on the loop thread by `stop()`.
+  static void on_stop(uv_async_t* handle) {
+    static_cast<DirWatcher*>(handle->data)->close_all();
+  }
+
+  static void on_close(uv_handle_t* handle) {
+    if (handle->type != UV_ASYNC) {
+      delete static_cast<Watch*>(handle->data);
+    }
+  }
+
+  static void close_handle(uv_handle_t* handle, void*) {
+    if (!uv_is_closing(handle)) {
+      uv_close(handle, on_close);
+    }
+  }
+
+  void close_all() {
+    watches_.clear();
+    uv_walk(&loop_, close_handle, NULL);
+  }
+
+  // The following are called on the main thread before the loop thread
+  // starts, and on the loop thread afterwards.
+
+  int lstat(const std::string& path, uv_stat_t* st) {
+    uv_fs_t req;
+    int err = uv_fs_lstat(&loop_, &req, path.c_str(), NULL);
+    if (err == 0) {
+      *st = req.statbuf;
+    } else {
+      memset(st, 0, sizeof(*st));
+    }
+    uv_fs_req_cleanup(&req);
+    return err;
+  }
+
+  int add_tree(const std::string& path, int recurse) {
+    if (watches_.count(path) > 0) {
+      return 0;
+    }
+    uv_stat_t st;
+    int err = lstat(path, &st);
+    if (err < 0) {
+      return err;
+    }
+    bool is_dir = (st.st_mode & S_IFMT) == S_IFDIR;
+    err = add_watch(path, is_dir, recurse);
+    if (err < 0) {
+      return err;
+    }
+    if (is_dir && recurse > 0 && !native_recursive_) {
+      add_children(path, recurse);
+    }
+    return 0;
+  }
+
+  // Watch the sub-directories of `path` which are not already watched. Other
+  // entries are only watched by their own handles when polling, as event
+  // handles for a directory also report changes to its files.
+  void add_children(const std::string& path, int recurse) {
+    DirHandle dir;
+    std::vector<DirEntry> entries;
+    if (dir.open(path) < 0 || dir.read(all_, false, &entries) < 0) {
+      return;
+    }
+    dir.close();
+    std::string prefix = dir_entry_prefix(path);
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (!poll_ && entries[i].type != UV_DIRENT_DIR) {
+        continue;
+      }
+      std::string child = prefix + entries[i].name;
+      int err = add_tree(child, recurse - 1);
+      if (err < 0) {
+        add_error(err, child);
+      }
+    }
+  }
+
+  int add_watch(const std::string& path, bool is_dir, int recurse) {
+    Watch* w = new Watch;
+    w->watcher = this;
+    w->path = path;
+    w->is_dir = is_dir;
+    w->recurse = recurse;
+    w->missing = false;
+
+    int err;
+    if (poll_) {
+      err = uv_fs_poll_init(&loop_, &w->poll);
+    } else {
+      err = uv_fs_event_init(&loop_, &w->event);
+    }
+    if (err < 0) {
+      delete w;
+      return err;
+    }
+    w->handle.data = w;
+    if (poll_) {
+      err = uv_fs_poll_start(&w->poll, on_poll, path.c_str(), interval_);
+    } else {
+      unsigned int flags = native_recursive_ ? UV_FS_EVENT_RECURSIVE : 0;
+      err = uv_fs_event_start(&w->event, on_event, path.c_str(), flags);
+    }
+    if (err < 0) {
+      uv_close(&w->handle, on_close);
+      return err;
+    }
+    watches_[path] = w;
+    return 0;
+  }
+
+  void remove_watch(const std::string& path) {
+    std::map<std::string, Watch*>::iterator it = watches_.find(path);
+    if (it != watches_.end()) {
+      uv_close(&it->second->handle, on_close);
+      watches_.erase(it);
+    }
+  }
+
+  // The following are called on the loop thread.
+
+  // Watch a directory which was created below a watched one, or stop
+  // watching a path which was removed.
+  void update(const std::string& path, int recurse) {
+    uv_stat_t st;
+    if (lstat(path, &st) < 0) {
+      remove_watch(path);
+      return;
+    }
+    if (recurse > 0 && (st.st_mode & S_IFMT) == S_IFDIR) {
+      int err = add_tree(path, recurse - 1);
+      if (err < 0) {
+        add_error(err, path);
+      }
+    }
+  }
+
+  static void
+  on_event(uv_fs_event_t* handle, const char* filename, int events, int status) {
+    Watch* w = static_cast<Watch*>(handle->data);
+    DirWatcher* self = w->watcher;
+    if (status < 0) {
+      self->add_error(status, w->path);
+      return;
+    }
+
+    std::string path = w->path;
+    if (w->is_dir && filename != NULL && filename[0] != '\0') {
+      if (!self->all_ && filename[0] == '.') {
+        return;
+      }
+      path = dir_entry_prefix(w->path) + filename;
+      // Events about the watched directory itself are reported with its
+      // own name, e.g. when it is removed.
+      uv_stat_t st;
+      if (strcmp(filename, base_name(w->path)) == 0 &&
+          self->lstat(path, &st) < 0) {
+        path = w->path;
+      }
+    }
+    std::string watched = w->path;
+    int recurse = w->recurse;
+    self->push(path, events);
+
+    // `w` may be freed once the handle is closed.
+    if ((events & UV_RENAME) && !self->native_recursive_) {
+      self->update(path, path == watched ? 0 : recurse);
+    }
+  }
+
+  static void on_poll(
+      uv_fs_poll_t* handle,
+      int status,
+      const uv_stat_t* prev,
+      const uv_stat_t* curr) {
+    Watch* w = static_cast<Watch*>(handle->data);
+    DirWatcher* self = w->watcher;
+    if (status < 0 && status != UV_ENOENT) {
+      self->add_error(status, w->path);
+      return;
+    }
+    // The path was removed or created, or replaced by another file.
+    bool renamed = status < 0 || w->missing || prev->st_ino != curr->st_ino ||
+                   prev->st_dev != curr->st_dev;
+    w->missing = status < 0;
+    self->push(w->path, renamed ? UV_RENAME : UV_CHANGE);
+
+    // Watch any new sub-directories of a changed directory.
+    if (status == 0 && (curr->st_mode & S_IFMT) == S_IFDIR && w->recurse > 0) {
+      self->add_children(w->path, w->recurse);
+    }
+  }
+
+  static const char* base_name(const std::string& path) {
+    size_t end = path.find_last_not_of('/');
+    if (end == std::string::npos) {
+      return path.c_str();
+    }
+    size_t start = path.find_last_of('/', end);
+    return path.c_str() + (start == std::string::npos ? 0 : start + 1);
+  }
+
+  void push(const std::string& path, int events) {
+    uv_mutex_lock(&mutex_);
+    std::map<std::string, int>::iterator it = queued_.find(path);
+    if (it == queued_.end()) {
+      queued_[path] = events;
+      order_.push_back(path);
+    } else {
+      it->second |= events;
+    }
+    uv_cond_signal(&cond_);
+    uv_mutex_unlock(&mutex_);
+  }
+
+  void add_error(int err, const std::string& path) {
+    Event e;
+    e.path = path;
+    e.events = err;
+    uv_mutex_lock(&mutex_);
+    errors_.push_back(e);
+    uv_cond_signal(&cond_);
+    uv_mutex_unlock(&mutex_);
+  }
+
+  int recurse_;
+  bool all_;
+  bool poll_;
+  unsigned int interval_;
+  bool native_recursive_;
+
+  uv_loop_t loop_;
+  uv_async_t stop_;
+  uv_thread_t thread_;
+  bool running_;
+  // Only used on the loop thread once it is running.
+  std::map<std::string, Watch*> watches_;
+
+  // The queue of events, guarded by `mutex_`. `order_` has the paths in the
+  // order they first changed, `queued_` their combined events.
+  uv_mutex_t mutex_;
+  uv_cond_t cond_;
+  std::vector<std::string> order_;
+  std::map<std::string, int> queued_;
+  // The errors of the loop thread, with the error code as the events.
+  std::vector<Event> errors_;
+};
+
+static DirWatcher* dir_watcher(SEXP ptr) {
+  if (TYPEOF(ptr) != EXTPTRSXP || R_ExternalPtrAddr(ptr) == NULL) {
+    Rf_error("Invalid watcher, it may have been stopped or saved and reloaded");
+  }
+  return static_cast<DirWatcher*>(R_ExternalPtrAddr(ptr));
+}
+
+// [[export]]
+extern "C" SEXP fs_dir_watch_(
+    SEXP path_sxp,
+    SEXP recurse_sxp,
+    SEXP all_sxp,
+    SEXP poll_sxp,
+    SEXP interval_sxp) {
+  int recurse = INTEGER(recurse_sxp)[0];
+  if (recurse < 0) {
+    recurse = std::numeric_limits<int>::max();
+  }
+  DirWatcher* watcher = new DirWatcher(
+      recurse,
+      LOGICAL(all_sxp)[0] == TRUE,
+      LOGICAL(poll_sxp)[0] == TRUE,
+      static_cast<unsigned int>(REAL(interval_sxp)[0] * 1000));
+
+  SEXP ptr = PROTECT(R_MakeExternalPtr(watcher, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, DirWatcher::finalize, TRUE);
+
+  for (R_xlen_t i = 0; i < Rf_xlength(path_sxp); ++i) {
+    const char* p = CHAR(STRING_ELT(path_sxp, i));
+    stop_for_code(watcher->add(p), "Failed to watch '%s'", p);
+  }
+  int err = watcher->start();
+  stop_for_code(err, "Failed to start watching '%s'", CHAR(STRING_ELT(path_sxp, 0)));
+
+  UNPROTECT(1);
+  return ptr;
+}
+
+// [[export]]
+extern "C" SEXP fs_dir_watch_events_(SEXP ptr, SEXP n_sxp, SEXP timeout_sxp) {
+  DirWatcher* watcher = dir_watcher(ptr);
+  double n = REAL(n_sxp)[0];
+  size_t max = n >= static_cast<double>(std::numeric_limits<size_t>::max())
+                   ? std::numeric_limits<size_t>::max()
+                   : static_cast<size_t>(n);
+
+  // The errors of the loop thread are signaled once the events are in the
+  // result and the vectors freed, as a handler may jump past their
+  // destructors.
+  const char* nms[] = {"path", "event", ""};
+  SEXP out = PROTECT(Rf_mkNamed(VECSXP, nms));
+  SEXP error_path;
+  SEXP error_code;
+  {
+    std::vector<DirWatcher::Event> events;
+    std::vector<DirWatcher::Event> errors;
+    watcher->drain(max, REAL(timeout_sxp)[0], &events, &errors);
+
+    SEXP path = Rf_allocVector(STRSXP, events.size());
+    SET_VECTOR_ELT(out, 0, path);
+    SEXP event = Rf_allocVector(STRSXP, events.size());
+    SET_VECTOR_ELT(out, 1, event);
+    for (size_t i = 0; i < events.size(); ++i) {
+      SET_STRING_ELT(path, i, Rf_mkChar(events[i].path.c_str()));
+      // A path which was renamed is reported as such, even if it also
+      // changed.
+      SET_STRING_ELT(
+          event,
+          i,
+          Rf_mkChar(events[i].events & UV_RENAME ? "rename" : "change"));
+    }
+
+    error_path = PROTECT(Rf_allocVector(STRSXP, errors.size()));
+    error_code = PROTECT(Rf_allocVector(INTSXP, errors.size()));
+    for (size_t i = 0; i < errors.size(); ++i) {
+      SET_STRING_ELT(error_path, i, Rf_mkChar(errors[i].path.c_str()));
+      INTEGER(error_code)[i] = errors[i].events;
+    }
+  }
+
+  for (R_xlen_t i = 0; i < Rf_xlength(error_path); ++i) {
+    warn_for_code(
+        INTEGER(error_code)[i],
+        "Failed to watch '%s'",
+        CHAR(STRING_ELT(error_path, i)));
+  }
+  UNPROTECT(3);
+  return out;
+}
+
+// [[export]]
+extern "C" SEXP fs_dir_watch_stop_(SEXP ptr) {
+  DirWatcher::finalize(ptr);
+  return R_NilValue;
+}